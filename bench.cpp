@@ -0,0 +1,224 @@
+/**
+ * bench.cpp
+ * UBCST Electrical Division
+ * Throughput benchmark for the NMEA parser and the position estimator.
+ *
+ * Usage: bench [--baseline sentences_per_sec] [nmea_log [sensor_log]]
+ * Replays a recorded NMEA log (one sentence per line), or a synthetic
+ * 10 Hz RMC drive when no log is given, and prints sentences and
+ * estimator steps per second. The estimator is driven by a recorded
+ * sensor log ("<x> <y> <speed>" per line, one per 50 Hz step, repeated
+ * as needed), or by a synthetic weave when none is given. With --baseline, exits 1 if the parser
+ * runs more than BENCH_TOLERANCE percent below it.
+ */
+
+#include <fstream>
+#include <math.h>
+
+#include "gps.h"
+#include "config.h"
+#include "estimator.h"
+
+/* Sentences in the synthetic log */
+#define BENCH_SENTENCES 200000
+
+/* Times the log is replayed through the parser */
+#define BENCH_PASSES 5
+
+/* Estimator predictions per GPS fix (50 Hz output, 10 Hz fixes) */
+#define BENCH_STEPS_PER_FIX 5
+
+/* Length of the synthetic sensor profile (50 Hz steps) */
+#define BENCH_SENSOR_STEPS 1000
+
+/* How far below the baseline the parser may run before failing (%) */
+#define BENCH_TOLERANCE 20
+
+static double seconds_since(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * synthetic_log()
+ * Builds an RMC log of a car heading east at 20 m/s
+ */
+static void synthetic_log(std::vector<std::string> &lines)
+{
+    char body[128];
+    char line[160];
+
+    for(int i = 0; i < BENCH_SENTENCES; i++)
+    {
+	double minutes = 6.0 + i * 0.0000163; /* ~2 m per fix at 49 N */
+	snprintf(body, sizeof(body),
+		 "GPRMC,%06d.%d0,A,4915.0000,N,123%07.4f,W,38.9,90.0,191026,,,A",
+		 120000 + i / 10, i % 10, minutes);
+	snprintf(line, sizeof(line), "$%s*%02X", body, nmea_checksum(body));
+	lines.push_back(line);
+    }
+}
+
+/**
+ * synthetic_sensor()
+ * Builds accelerometer and speed readings for a car weaving gently
+ * around 20 m/s, so the filter integrates non-zero acceleration
+ */
+static void synthetic_sensor(std::vector<sensor_data> &readings)
+{
+    sensor_data sensor;
+    memset(&sensor, 0, sizeof(sensor));
+
+    for(int i = 0; i < BENCH_SENSOR_STEPS; i++)
+    {
+	double t = i / 50.0;
+	sensor.x = 0.8 * sin(2 * M_PI * t / 6.0);
+	sensor.y = 1.5 * sin(2 * M_PI * t / 4.0);
+	sensor.z = 9.81;
+	sensor.speed = 20.0 - 0.8 * 6.0 / (2 * M_PI) * cos(2 * M_PI * t / 6.0);
+	readings.push_back(sensor);
+    }
+}
+
+/**
+ * read_sensor_log()
+ * Returns:
+ *   0 - if at least one reading was read
+ *   1 - otherwise
+ */
+static int read_sensor_log(const char *path, std::vector<sensor_data> &readings)
+{
+    std::ifstream log(path);
+    sensor_data sensor;
+    memset(&sensor, 0, sizeof(sensor));
+
+    while(log >> sensor.x >> sensor.y >> sensor.speed)
+	readings.push_back(sensor);
+
+    return readings.empty() ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char prog[] = "bench";
+    char quiet[] = "--log_level=error";
+    char *configArgs[] = { prog, quiet };
+    config_load(2, configArgs);
+
+    long baseline = 0;
+    int arg = 1;
+    if(argc > 2 && strcmp(argv[1], "--baseline") == 0)
+    {
+	baseline = atol(argv[2]);
+	arg = 3;
+    }
+
+    std::vector<std::string> lines;
+    if(argc > arg)
+    {
+	std::ifstream log(argv[arg]);
+	std::string line;
+	while(getline(log, line))
+	{
+	    if(!line.empty() && line[line.size() - 1] == '\r')
+		line.erase(line.size() - 1);
+	    lines.push_back(line);
+	}
+	if(lines.empty())
+	{
+	    std::cout << "No sentences in " << argv[arg] << std::endl;
+	    return 1;
+	}
+    }
+    else
+    {
+	synthetic_log(lines);
+    }
+
+    /* Parser: checksum, split and RMC decode */
+    std::vector<gps_data> fixes;
+    struct timespec start;
+    unsigned long parsed = 0;
+    gps_data data;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int pass = 0; pass < BENCH_PASSES; pass++)
+    {
+	for(size_t i = 0; i < lines.size(); i++)
+	{
+	    const std::string &line = lines[i];
+	    if(nmea_verify(line) != 0)
+		continue;
+
+	    std::vector<std::string> nmeaLine = split(line, ',');
+	    if(gps_parse(data, nmeaLine) == 0)
+	    {
+		parsed++;
+		if(pass == 0)
+		    fixes.push_back(data);
+	    }
+	}
+    }
+    double parseTime = seconds_since(start);
+    unsigned long sentences = lines.size() * BENCH_PASSES;
+
+    long rate = (long)(sentences / parseTime);
+    std::cout << "parse: " << sentences << " sentences, " << parsed
+	      << " fixes, " << rate << " sentences/s" << std::endl;
+
+    /* Estimator: predictions between fixes plus one update per fix */
+    std::vector<sensor_data> readings;
+    if(argc > arg + 1)
+    {
+	if(read_sensor_log(argv[arg + 1], readings) != 0)
+	{
+	    std::cout << "No readings in " << argv[arg + 1] << std::endl;
+	    return 1;
+	}
+    }
+    else
+    {
+	synthetic_sensor(readings);
+    }
+
+    estimator est;
+    est_config estConfig = { 50.0, EST_ACCEL_NOISE, EST_GPS_NOISE,
+			     EST_SPEED_NOISE };
+    est_position position;
+
+    est_init(est, estConfig);
+    double dt = est_period_us(est) / 1e6;
+    unsigned long steps = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(size_t i = 0; i < fixes.size(); i++)
+    {
+	est_update_gps(est, fixes[i]);
+	for(int s = 0; s < BENCH_STEPS_PER_FIX; s++)
+	{
+	    const sensor_data &sensor = readings[steps % readings.size()];
+	    est_predict(est, sensor, dt);
+	    est_update_speed(est, sensor.speed);
+	    est_output(est, position);
+	    steps++;
+	}
+    }
+    double estTime = seconds_since(start);
+
+    if(steps > 0)
+	std::cout << "estimator: " << steps << " steps, "
+		  << (long)(steps / estTime) << " steps/s, final "
+		  << position.latitude << ", " << position.longitude
+		  << std::endl;
+
+    if(baseline > 0 && rate < baseline * (100 - BENCH_TOLERANCE) / 100)
+    {
+	std::cout << "FAIL: parser below baseline of " << baseline
+		  << " sentences/s" << std::endl;
+	return 1;
+    }
+
+    return 0;
+}
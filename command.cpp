@@ -0,0 +1,154 @@
+/**
+ * command.cpp
+ * UBCST Electrical Division
+ * Commands sent from the phone to the car.
+ */
+
+#include <atomic>
+
+#include "command.h"
+#include "config.h"
+
+/* Live settings changed by commands */
+static std::atomic<int> sampleRates[NUM_STREAMS];
+static std::atomic<int> requestedGpsRate(0);
+
+/* Arguments of a received command, pointing into the receive buffer */
+struct cmd_args
+{
+    const unsigned char *data;
+    int length;
+};
+
+typedef cmd_status (*cmd_handler)(rely_session &session, uint16_t id,
+				  const cmd_args &args);
+
+/* Dispatch table entry */
+struct cmd_entry
+{
+    cmd_handler handler;
+    int arg_size; /* exact payload length the command expects */
+};
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/**
+ * send_text()
+ * Sends a text reply on the guaranteed class
+ */
+static void send_text(rely_session &session, const char *text, int length)
+{
+    if(rely_send(session, CLASS_ALARM, (const unsigned char *)text, length) != 0
+       && log_enabled(LOG_INFO))
+	std::cout << "Command reply dropped: " << text << std::endl;
+}
+
+static cmd_status cmd_ping(rely_session &session, uint16_t id,
+			   const cmd_args &)
+{
+    char reply[32];
+    int length = snprintf(reply, sizeof(reply), "$PONG,%u,$END", id);
+    send_text(session, reply, length);
+    return CMD_OK;
+}
+
+static cmd_status cmd_set_sample_rate(rely_session &, uint16_t,
+				      const cmd_args &args)
+{
+    int stream = args.data[0];
+    int rate = get_u16(&args.data[1]);
+
+    if(stream >= NUM_STREAMS || rate < 1 || rate > CMD_MAX_SAMPLE_RATE)
+	return CMD_BAD_VALUE;
+
+    /* No sampling loop reads the sensor rate yet */
+    if(stream == STREAM_SENSOR)
+	return CMD_UNSUPPORTED;
+
+    sampleRates[stream].store(rate, std::memory_order_relaxed);
+    return CMD_OK;
+}
+
+static cmd_status cmd_request_backlog(rely_session &, uint16_t,
+				      const cmd_args &)
+{
+    /* Nothing on the car keeps telemetry history yet */
+    return CMD_UNSUPPORTED;
+}
+
+static cmd_status cmd_set_gps_rate(rely_session &, uint16_t,
+				   const cmd_args &args)
+{
+    int rate = args.data[0];
+
+    if(rate < 1 || rate > 10)
+	return CMD_BAD_VALUE;
+
+    requestedGpsRate.store(rate, std::memory_order_relaxed);
+    return CMD_OK;
+}
+
+/* Handlers indexed by cmd_type */
+static const cmd_entry CMD_TABLE[NUM_CMD_TYPES] =
+{
+    /* CMD_PING */            { cmd_ping, 0 },
+    /* CMD_SET_SAMPLE_RATE */ { cmd_set_sample_rate, 3 },
+    /* CMD_REQUEST_BACKLOG */ { cmd_request_backlog, 2 },
+    /* CMD_SET_GPS_RATE */    { cmd_set_gps_rate, 1 }
+};
+
+void cmd_init(void)
+{
+    const telemetry_config &config = config_get();
+
+    sampleRates[STREAM_SENSOR].store(config.sensor_rate_hz);
+    sampleRates[STREAM_ESTIMATOR].store(config.estimator_rate_hz);
+    requestedGpsRate.store(0);
+}
+
+void cmd_handle_frame(rely_session &session, const unsigned char *frame,
+		      int length)
+{
+    if(length < FRAME_HEADER_SIZE || frame[0] != FRAME_SYNC
+       || frame[1] != FRAME_CMD)
+    {
+	if(log_enabled(LOG_DEBUG))
+	    std::cout << "Unknown inbound frame, " << length << " bytes"
+		      << std::endl;
+	return;
+    }
+
+    int type = frame[2];
+    uint16_t id = get_u16(&frame[4]);
+    cmd_args args = { &frame[FRAME_HEADER_SIZE], get_u16(&frame[6]) };
+    cmd_status status;
+
+    if(type >= NUM_CMD_TYPES)
+	status = CMD_BAD_TYPE;
+    else if(args.length != CMD_TABLE[type].arg_size
+	    || FRAME_HEADER_SIZE + args.length > length)
+	status = CMD_BAD_LENGTH;
+    else
+	status = CMD_TABLE[type].handler(session, id, args);
+
+    char reply[48];
+    int replyLength = snprintf(reply, sizeof(reply), "$ACK,%d,%u,%d,$END",
+			       type, id, status);
+    send_text(session, reply, replyLength);
+}
+
+int cmd_sample_rate(cmd_stream stream)
+{
+    if(stream < 0 || stream >= NUM_STREAMS)
+	return 0;
+
+    return sampleRates[stream].load(std::memory_order_relaxed);
+}
+
+int cmd_gps_rate(void)
+{
+    return requestedGpsRate.load(std::memory_order_relaxed);
+}
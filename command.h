@@ -0,0 +1,103 @@
+/**
+ * command.h
+ * UBCST Electrical Division
+ * Commands sent from the phone to the car.
+ *
+ * Commands arrive as FRAME_CMD frames (see reliable.h): byte 2 holds the
+ * command type, bytes 4-5 a command ID chosen by the phone, and the
+ * payload the arguments as packed little-endian fields. Arguments are
+ * decoded directly from the receive buffer and dispatched through a
+ * table indexed by command type.
+ *
+ * Handlers run on whichever thread calls rely_poll() and only publish
+ * new settings through atomics, so they never block acquisition. The
+ * threads that own each setting pick changes up with the cmd_*
+ * accessors below.
+ *
+ * Every command is answered on CLASS_ALARM with
+ *   "$ACK,<type>,<id>,<status>,$END"
+ * and a ping additionally with "$PONG,<id>,$END". A setting that no
+ * loop applies yet is answered CMD_UNSUPPORTED rather than CMD_OK.
+ */
+
+#include <stdint.h>
+
+#include "reliable.h"
+
+/* Header Guard */
+#ifndef COMMAND_H
+#define COMMAND_H
+
+/* Command types */
+enum cmd_type
+{
+    CMD_PING = 0,            /* no arguments */
+    CMD_SET_SAMPLE_RATE = 1, /* u8 stream, u16 rate in Hz */
+    CMD_REQUEST_BACKLOG = 2, /* u16 first sequence number */
+    CMD_SET_GPS_RATE = 3,    /* u8 fix rate in Hz, 1 to 10 */
+    NUM_CMD_TYPES
+};
+
+/* Streams whose sample rate can be changed */
+enum cmd_stream
+{
+    STREAM_SENSOR = 0,
+    STREAM_ESTIMATOR = 1,
+    NUM_STREAMS
+};
+
+/* Reply status codes */
+enum cmd_status
+{
+    CMD_OK = 0,
+    CMD_BAD_TYPE = 1,
+    CMD_BAD_LENGTH = 2,
+    CMD_BAD_VALUE = 3,
+    CMD_UNSUPPORTED = 4
+};
+
+/* Largest sample rate a command may request (Hz) */
+#define CMD_MAX_SAMPLE_RATE 1000
+
+/**
+ * cmd_init()
+ * Seeds the live settings from the configuration. Call once after
+ * config_load().
+ * Returns:
+ *   None
+ */
+void cmd_init(void);
+
+/**
+ * cmd_handle_frame()
+ * Decodes and dispatches one inbound frame. Install as the rely_session
+ * on_frame hook.
+ * Parameters:
+ *   session - the session the frame arrived on, used for the reply
+ *   frame - the received frame
+ *   length - the number of bytes received
+ * Returns:
+ *   None
+ */
+void cmd_handle_frame(rely_session &session, const unsigned char *frame,
+		      int length);
+
+/**
+ * cmd_sample_rate()
+ * Parameters:
+ *   stream - the stream
+ * Returns:
+ *   the current sample rate of the stream in Hz
+ */
+int cmd_sample_rate(cmd_stream stream);
+
+/**
+ * cmd_gps_rate()
+ * The GPS fix rate the phone asked for. The thread that owns the GPS
+ * port treats it as a ceiling, which the governor may scale down.
+ * Returns:
+ *   the requested rate in Hz, or 0 if the phone has not set one
+ */
+int cmd_gps_rate(void);
+
+#endif /* End header guard */
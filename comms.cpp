@@ -14,190 +14,348 @@
 
 #include "comms.h"
 
-/* Set to 1 for diagnostic messages, 0 for no messages */
-#define TEST_MODE 1
+/* Interface claimed by usb_init(), released by usb_close() */
+static int claimedInterface = -1;
 
 /**
- * usb_init()
- * Initializes the USBs session
- * Parameters: 
- *   handle - the uninitialized device handle
- *   context - the libusb session
- *   device - the list of devices
+ * open_accessory()
+ * Opens the phone if it is already in accessory mode
  * Returns:
- *   0 - if no error occured
- *   1 - if error occurs during initialization
+ *   the device handle, or NULL if no accessory is attached
  */
-int usb_init(libusb_device **device, libusb_device_handle *&handle)
+static libusb_device_handle *open_accessory(void)
 {
-    int deviceCount = 0;
-    int returnVal = 0;
-
-    /* Initialize the libusb session */
-    returnVal = libusb_init(NULL);
-    if(returnVal < 0)
-    {
-	std::cout << "USB Initialization Error: " << returnVal << std::endl;
-	return 1;
-    }
+    libusb_device_handle *handle;
 
-    /* Open the device using its Vendor and Product IDs */
-    handle = libusb_open_device_with_vid_pid(NULL, PHONE_VID, PHONE_PID);
+    handle = libusb_open_device_with_vid_pid(NULL, ACC_VID, ACC_PID);
     if(handle == NULL)
+	handle = libusb_open_device_with_vid_pid(NULL, ACC_VID, ACC_PID_ADB);
+
+    return handle;
+}
+
+/**
+ * interface_driver()
+ * Looks up the driver bound to an interface in sysfs
+ * (/sys/bus/usb/devices/<bus>-<port.port...>:<config>.<interface>/driver)
+ * Parameters:
+ *   device - the USB device
+ *   config - the configuration value
+ *   iface - the interface number
+ * Returns:
+ *   the driver name, "usbfs" if a user-space program holds the
+ *   interface, or an empty string if no driver is bound
+ */
+static std::string interface_driver(libusb_device *device, int config,
+				    int iface)
+{
+    uint8_t ports[8];
+    int numPorts = libusb_get_port_numbers(device, ports, sizeof(ports));
+    if(numPorts <= 0)
+	return "";
+
+    std::ostringstream path;
+    path << "/sys/bus/usb/devices/" << (int)libusb_get_bus_number(device) << "-";
+    for(int i = 0; i < numPorts; i++)
+	path << (i ? "." : "") << (int)ports[i];
+    path << ":" << config << "." << iface << "/driver";
+
+    char target[256];
+    ssize_t len = readlink(path.str().c_str(), target, sizeof(target) - 1);
+    if(len < 0)
+	return "";
+    target[len] = '\0';
+
+    const char *name = strrchr(target, '/');
+    return name ? name + 1 : target;
+}
+
+/**
+ * is_accessory_interface()
+ * Checks whether an interface is the AOA accessory interface: vendor
+ * specific with bulk endpoints matching the configured IN and OUT points
+ */
+static bool is_accessory_interface(const libusb_interface_descriptor &alt)
+{
+    const telemetry_config &config = config_get();
+    bool hasIn = false;
+    bool hasOut = false;
+
+    if(alt.bInterfaceClass != LIBUSB_CLASS_VENDOR_SPEC)
+	return false;
+
+    for(int e = 0; e < alt.bNumEndpoints; e++)
     {
-        std::cout << "Device may already be in accessory mode. Checking..." << std::endl;
-        handle = libusb_open_device_with_vid_pid(NULL, ACC_VID, ACC_PID_ADB);
-
-        if(handle == NULL) {
-            std::cout << "Device Open Error" << std::endl;
-            return 1;
-        } else {
-            std::cout << "Device Handle: " << handle << std::endl;
-        }
+	const libusb_endpoint_descriptor &ep = alt.endpoint[e];
+	if((ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+	   != LIBUSB_TRANSFER_TYPE_BULK)
+	    continue;
+
+	if(ep.bEndpointAddress == config.in_point)
+	    hasIn = true;
+	if(ep.bEndpointAddress == config.out_point)
+	    hasOut = true;
     }
 
-    /* Setup Accessory Mode on both devices */
-    setupAccessory(handle);
+    return hasIn && hasOut;
+}
 
-    /* Unmount the devices if the device is not in accessory mode. */
-    const char *dirname = "/run/user/1000/gvfs/";
-    unmount_devices( dirname );
+/**
+ * accessory_arrived()
+ * Hotplug callback: keeps the first device that enumerates with an
+ * accessory PID
+ */
+static int LIBUSB_CALL accessory_arrived(libusb_context *,
+					 libusb_device *device,
+					 libusb_hotplug_event,
+					 void *user_data)
+{
+    libusb_device **found = (libusb_device **)user_data;
+    struct libusb_device_descriptor desc;
 
-    /* Auto-detach drivers */
-    returnVal = libusb_set_auto_detach_kernel_driver(handle, 1);
-    if(returnVal != 0)
+    if(*found != NULL || libusb_get_device_descriptor(device, &desc) != 0)
+	return 0;
+
+    if(desc.idProduct == ACC_PID || desc.idProduct == ACC_PID_ADB)
     {
-	std::cout << "Auto detach error: " << libusb_error_name(returnVal) 
-		  << std::endl;
+	*found = libusb_ref_device(device);
+	return 1; /* deregister */
     }
 
-    /* Check if device is attached to the kernel, detach if it is */
-    returnVal = libusb_kernel_driver_active(handle, 0);
-    if(returnVal == 1)
-    {
-	std::cout << "Kernel driver attached: " << returnVal << std::endl;
+    return 0;
+}
+
+/**
+ * wait_for_accessory()
+ * Waits for the phone to re-enumerate in accessory mode. Uses hotplug
+ * events where libusb supports them, otherwise checks at a fixed
+ * interval.
+ * Parameters:
+ *   timeout_ms - how long to wait
+ * Returns:
+ *   the accessory handle, or NULL if it did not appear in time
+ */
+static libusb_device_handle *wait_for_accessory(int timeout_ms)
+{
+    libusb_device_handle *handle = NULL;
 
-	/* Detach the kernel driver */
-	returnVal = libusb_detach_kernel_driver(handle, 0);
-	if(returnVal < 0)
+    if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+	for(int waited = 0; handle == NULL && waited < timeout_ms;
+	    waited += ACC_POLL_INTERVAL)
 	{
-	    std::cout << "Kernel Detach Error: " << returnVal <<std::endl;
-	    return 1;
+	    usleep(ACC_POLL_INTERVAL * 1000);
+	    handle = open_accessory();
 	}
+	return handle;
     }
-    else if(returnVal == 0)
+
+    libusb_device *found = NULL;
+    libusb_hotplug_callback_handle callback;
+    int returnVal = libusb_hotplug_register_callback(
+	NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+	ACC_VID, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+	accessory_arrived, &found, &callback);
+    if(returnVal != 0)
     {
-	std::cout << "Kernel driver inactive: " << returnVal <<std::endl;
+	std::cout << "Hotplug register error: "
+		  << libusb_error_name(returnVal) << std::endl;
+	return NULL;
+    }
 
-	/* Claim device interface */
-	returnVal = libusb_claim_interface(handle, 0);
-	if(returnVal < 0)
-	{
-	    std::cout << "Claim Interface Error: " << returnVal 
-		      << " " << libusb_error_name(returnVal) << std::endl;
-	    return 1;
-	}
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long elapsed = 0;
+
+    while(found == NULL && elapsed < timeout_ms)
+    {
+	struct timeval tv;
+	tv.tv_sec = (timeout_ms - elapsed) / 1000;
+	tv.tv_usec = ((timeout_ms - elapsed) % 1000) * 1000;
+	libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start.tv_sec) * 1000
+	    + (now.tv_nsec - start.tv_nsec) / 1000000;
     }
-    else 
+
+    if(found == NULL)
     {
-	std::cout << "Kernel driver error: " << returnVal << std::endl;
-	return 1;
+	libusb_hotplug_deregister_callback(NULL, callback);
+	return NULL;
     }
 
-    if(TEST_MODE)
-	std::cout << "Init Successful. Begin data transfer." << std::endl;
+    returnVal = libusb_open(found, &handle);
+    libusb_unref_device(found);
+    if(returnVal != 0)
+    {
+	std::cout << "Accessory Open Error: " << libusb_error_name(returnVal)
+		  << std::endl;
+	return NULL;
+    }
 
-    return 0;
+    return handle;
 }
 
 /**
- * send_data()
- * Parameters:
- *   handle - the device handle
- *   message - the message string
+ * claim_accessory()
+ * Finds the accessory interface in the active configuration, detaches
+ * whatever kernel driver holds it and claims it. Interfaces held by
+ * other drivers are reported but left alone.
  * Returns:
- *   0 - if transfer is successful
- *   1 - if transfer fails
+ *   0 - if the interface was claimed
+ *   1 - otherwise
  */
-int send_data(libusb_device_handle *handle, unsigned char *message, int msg_size)
+static int claim_accessory(libusb_device_handle *handle)
 {
-    unsigned char buffer[256] = "$GPS,123.01,N,456.02,W,10:09:08,$END";
+    libusb_device *device = libusb_get_device(handle);
+    struct libusb_config_descriptor *desc = NULL;
+    int accessory = -1;
     int returnVal;
-    int actual;
 
-    std::cout << "Begin send data..." << std::endl << std::endl;
+    returnVal = libusb_get_active_config_descriptor(device, &desc);
+    if(returnVal != 0)
+    {
+	std::cout << "Config descriptor error: "
+		  << libusb_error_name(returnVal) << std::endl;
+	return 1;
+    }
 
-    std::cout << buffer << " - Size of: " << msg_size << std::endl;
+    for(int i = 0; i < desc->bNumInterfaces; i++)
+    {
+	if(desc->interface[i].num_altsetting < 1)
+	    continue;
 
-    /* Transfer data to device */
-    returnVal = libusb_bulk_transfer(handle, 
-				     OUT_POINT, 
-				     buffer,
-				     msg_size, 
-				     &actual, 
-				     1000);
-    std::cout << "Bulk transfer error: " << libusb_error_name(returnVal) 
-		  << std::endl;
+	const libusb_interface_descriptor &alt = desc->interface[i].altsetting[0];
+	std::string driver = interface_driver(device, desc->bConfigurationValue,
+					      alt.bInterfaceNumber);
+
+	if(log_enabled(LOG_DEBUG))
+	    std::cout << "Interface " << (int)alt.bInterfaceNumber
+		      << " class " << (int)alt.bInterfaceClass
+		      << " driver " << (driver.empty() ? "none" : driver)
+		      << std::endl;
 
+	if(accessory < 0 && is_accessory_interface(alt))
+	    accessory = alt.bInterfaceNumber;
+    }
 
-    if(TEST_MODE)
+    int config = desc->bConfigurationValue;
+    libusb_free_config_descriptor(desc);
+
+    if(accessory < 0)
     {
-	std::cout << "Bytes sent: " << actual << " of " << sizeof(message)
-		  << std::endl;
+	std::cout << "No accessory interface found" << std::endl;
+	return 1;
+    }
 
-	if((returnVal == 0) && actual == sizeof(message))
-	{
-	    std::cout << "Message sent successfully!" << std::endl;
-	    return 0;
-	}
-	else
+    std::string driver = interface_driver(device, config, accessory);
+
+    /* usbfs means another program (e.g. an MTP/PTP service) claimed it;
+     * libusb can only detach kernel drivers. */
+    if(driver == "usbfs")
+    {
+	std::cout << "Interface " << accessory
+		  << " is held by another program" << std::endl;
+	return 1;
+    }
+
+    if(!driver.empty())
+    {
+	returnVal = libusb_detach_kernel_driver(handle, accessory);
+	if(returnVal != 0 && returnVal != LIBUSB_ERROR_NOT_FOUND)
 	{
-	    std::cout << "Message not sent! Actual: " << actual << ", Message: " 
-		      << sizeof(message) << std::endl;
+	    std::cout << "Kernel Detach Error: " << driver << " "
+		      << libusb_error_name(returnVal) << std::endl;
 	    return 1;
 	}
     }
 
-    return returnVal;
+    returnVal = libusb_claim_interface(handle, accessory);
+    if(returnVal < 0)
+    {
+	std::cout << "Claim Interface Error: " << returnVal
+		  << " " << libusb_error_name(returnVal) << std::endl;
+	return 1;
+    }
+
+    claimedInterface = accessory;
+    return 0;
 }
 
 /**
- * receive_data()
+ * usb_abort()
+ * Closes a partly initialized session after usb_init() fails
+ */
+static void usb_abort(libusb_device_handle *&handle)
+{
+    if(handle != NULL)
+	libusb_close(handle);
+
+    handle = NULL;
+    libusb_exit(NULL);
+}
+
+/**
+ * usb_init()
+ * Initializes the USBs session
  * Parameters: 
- *   handle - the device handle
- *   message - the message string
+ *   handle - the uninitialized device handle
  * Returns:
- *   0 - if receive is successful
- *   1 - if receive fails
+ *   0 - if no error occured
+ *   1 - if error occurs during initialization
  */
-int receive_data(libusb_device_handle *handle, unsigned char *message)
+int usb_init(libusb_device_handle *&handle)
 {
-    int returnVal;
-    int actual;
+    const telemetry_config &config = config_get();
+    int returnVal = 0;
+
+    handle = NULL;
 
-    /* Transfer data to device */
-    returnVal = libusb_bulk_transfer(handle, IN_POINT, message,
-				     sizeof(message), &actual, 0);
+    /* Initialize the libusb session */
+    returnVal = libusb_init(NULL);
+    if(returnVal < 0)
+    {
+	std::cout << "USB Initialization Error: " << returnVal << std::endl;
+	return 1;
+    }
 
-    if(TEST_MODE)
+    /* Reconnects find the phone still in accessory mode */
+    handle = open_accessory();
+    if(handle == NULL)
     {
-	if((returnVal == 0) && actual == sizeof(message))
+	/* Open the device using its Vendor and Product IDs */
+	handle = libusb_open_device_with_vid_pid(NULL, config.phone_vid,
+						 config.phone_pid);
+	if(handle == NULL)
 	{
-	    std::cout << "Message sent successfully!" << std::endl;
-	    return 0;
+	    std::cout << "Device Open Error" << std::endl;
+	    usb_abort(handle);
+	    return 1;
 	}
-	else
+
+	/* Setup Accessory Mode on both devices */
+	if(setupAccessory(handle) != 0)
 	{
-	    std::cout << "Message not sent! Actual: " << actual << ", Message: " 
-		      << sizeof(message) << std::endl;
+	    usb_abort(handle);
 	    return 1;
 	}
     }
 
-    return returnVal;
-}
+    if(log_enabled(LOG_DEBUG))
+	std::cout << "Device Handle: " << handle << std::endl;
 
+    if(claim_accessory(handle) != 0)
+    {
+	usb_abort(handle);
+	return 1;
+    }
 
+    if(log_enabled(LOG_DEBUG))
+	std::cout << "Init Successful. Begin data transfer." << std::endl;
+
+    return 0;
+}
 
 /**
  * usb_close()
@@ -212,9 +370,10 @@ int usb_close(libusb_device_handle *handle)
     int returnVal = 0;
 
     /* If device handle interface was claimed, release the interface */
-    if(handle != NULL)
+    if(handle != NULL && claimedInterface >= 0)
     {
-	returnVal = libusb_release_interface(handle, 0);
+	returnVal = libusb_release_interface(handle, claimedInterface);
+	claimedInterface = -1;
 
 	if(returnVal != 0)
 	{
@@ -235,54 +394,23 @@ int usb_close(libusb_device_handle *handle)
     return 0;
 }
 
-/**
- * unmount_devices()
- * Check if device(s) are mounted by gvfs. If it is, unmount the device(s).
- * Source: http://stackoverflow.com/questions/6383584/check-if-a-directory-is-empty-using-c-on-linux
- * Parameters:
- *   dirname - the directory where the device(s) are unmounted.
- */
-void unmount_devices( const char *dirname ) {
-    DIR *dir = opendir(dirname);
-    int n = 0;
-    struct dirent *d;
-
-    if( dir != NULL ) {
-        while( ( d = readdir( dir ) ) != NULL ) {
-            // n > 2 to ignore the "." and ".." options when reading a
-            // directory
-            if( ++n > 2 ) {
-               std::string path = dirname + std::string(d->d_name);
-               std::string cmd = "gvfs-mount -u ";
-               std::string fullCmd = cmd + path;
-               std::cout << fullCmd << std::endl;
-               system( fullCmd.c_str() );
-               break;
-            }
-        }
-        closedir(dir);
-    } else {
-       std::cout << "cannot open dir " << errno << std::endl;
-    }
-}
-
 /**
  * setupAccessory()
  * Accessory setup follows the AOA Protocol for setting up Android
  * Accessory Mode in both devices.
  * Parameters:
- *   handle - the handle of the device
+ *   handle - the handle of the device, replaced by the handle of the
+ *            re-enumerated accessory on success
  * Returns:
  *   0 - if successful
  *   1 - if error occurs
  */
-int setupAccessory(libusb_device_handle *handle)
+int setupAccessory(libusb_device_handle *&handle)
 {
+	const telemetry_config &config = config_get();
 	unsigned char ioBuffer[2];
 	int devVersion;
 	int response;
-	int counter = 0;
-	int tries = 5;
 
 	response = libusb_control_transfer(handle, /* handle */
 					   0xC0, /* bmRequestType */
@@ -305,8 +433,8 @@ int setupAccessory(libusb_device_handle *handle)
 	usleep(1000);//sometimes hangs on the next transfer :(
 
 	response = libusb_control_transfer(handle,0x40,52,0,0,
-					   (unsigned char*)MANUFACTURER,
-					   sizeof(MANUFACTURER),0);
+					   (unsigned char*)config.manufacturer.c_str(),
+					   config.manufacturer.size()+1,0);
 	if(response < 0)
 	{
 	    std::cout << "Error: " << libusb_error_name(response) << std::endl;
@@ -314,8 +442,8 @@ int setupAccessory(libusb_device_handle *handle)
 	}
 
 	response = libusb_control_transfer(handle,0x40,52,0,1,
-					   (unsigned char*)MODEL,
-					   sizeof(MODEL)+1,0);
+					   (unsigned char*)config.model.c_str(),
+					   config.model.size()+1,0);
 	if(response < 0)
 	{
 	    std::cout << "Error: " << libusb_error_name(response) << std::endl;
@@ -323,8 +451,8 @@ int setupAccessory(libusb_device_handle *handle)
 	}
 
 	response = libusb_control_transfer(handle,0x40,52,0,2,
-					   (unsigned char*)DESCRIPTION,
-					   sizeof(DESCRIPTION)+1,0);	
+					   (unsigned char*)config.description.c_str(),
+					   config.description.size()+1,0);	
 	if(response < 0)
 	{
 	    std::cout << "Error: " << libusb_error_name(response) << std::endl;
@@ -332,8 +460,8 @@ int setupAccessory(libusb_device_handle *handle)
 	}
 
 	response = libusb_control_transfer(handle,0x40,52,0,3,
-					   (unsigned char*)VERSION,
-					   sizeof(VERSION)+1,0);
+					   (unsigned char*)config.version.c_str(),
+					   config.version.size()+1,0);
 	if(response < 0)
 	{
 	    std::cout << "Error: " << libusb_error_name(response) << std::endl;
@@ -341,8 +469,8 @@ int setupAccessory(libusb_device_handle *handle)
 	}
 
 	response = libusb_control_transfer(handle,0x40,52,0,4,
-					   (unsigned char*)URI,
-					   sizeof(URI)+1,0);
+					   (unsigned char*)config.uri.c_str(),
+					   config.uri.size()+1,0);
 	if(response < 0)
 	{
 	    std::cout << "Error: " << libusb_error_name(response) << std::endl;
@@ -350,8 +478,8 @@ int setupAccessory(libusb_device_handle *handle)
 	}
 
 	response = libusb_control_transfer(handle,0x40,52,0,5,
-					   (unsigned char*)SERIALNO,
-					   sizeof(SERIALNO)+1,0);
+					   (unsigned char*)config.serial.c_str(),
+					   config.serial.size()+1,0);
 	if(response < 0)
 	{
 	    std::cout << "Error: " << libusb_error_name(response) << std::endl;
@@ -368,28 +496,13 @@ int setupAccessory(libusb_device_handle *handle)
 	    return 1;
 	}
 
-	/* Reconnect the device using the accessory PID */
-	if(handle != NULL)
-	{
-	    libusb_release_interface(handle, 0);
-	    libusb_close(handle);
-	}
-
-	sleep(1);
-
-	/* If connection fails, try ACC_PID instead of ACC_PID_ADB */
-	for(counter = 0; counter < tries; counter++)
+	/* The phone drops off the bus and re-enumerates as an accessory */
+	libusb_close(handle);
+	handle = wait_for_accessory(ACC_ENUM_TIMEOUT);
+	if(handle == NULL)
 	{
-
-	    /* Open the device using its Vendor and Product IDs */
-	    handle = libusb_open_device_with_vid_pid(NULL, ACC_VID, ACC_PID_ADB);
-	    if(handle == NULL)
-	    {
-		std::cout << "Error opening with ACC PID: " << counter + 1
-			  << " of " << tries << std::endl;
-		if(counter == 4)
-		    return 1;
-	    }
+	    std::cout << "Accessory did not re-enumerate" << std::endl;
+	    return 1;
 	}
 
 	return 0;
@@ -25,7 +25,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <termios.h>
-#include <dirent.h>
+#include <time.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <libusb.h>
 
@@ -33,13 +34,9 @@
 #ifndef COMMS_H
 #define COMMS_H
 
-/* Product ID of Android phone */
- #define PHONE_PID 0x6765 /* Oneplus One Product ID */
-//#define PHONE_PID 0x4ee2 /* Nexus 5 Product ID */
-
-/* Vendor ID of Android phone */
- #define PHONE_VID 0x05c6 /* Oneplus One Vendor ID */
-//#define PHONE_VID 0x18d1 /* Nexus 5 Vendor ID */
+/* Phone IDs, endpoints and accessory strings are runtime settings,
+ * see config.h */
+#include "config.h"
 
 /* Accessory Mode-specific VID and PIDs */
 #define ACC_VID 0x18d1 /* Accessory Mode VID */
@@ -47,46 +44,28 @@
 #define ACC_PID_ADB 0x2d01 /* Accessory Mode PID with ADB active */
 #define ACC_PID 0x2d00 /* Accessory Mode PID with no PID */
 
-/* In point of the Oneplus One */
-#define IN_POINT 0x81
+/* How long the phone may take to re-enumerate as an accessory (ms) */
+#define ACC_ENUM_TIMEOUT 5000
 
-/* Out point of the Oneplus One */
-#define OUT_POINT 0x02
+/* Check interval when libusb has no hotplug support (ms) */
+#define ACC_POLL_INTERVAL 50
 
+/* Largest frame exchanged with the phone */
 #define USB_MSG_SIZE 256
 
-/* Accessory configuration data */
-#define MANUFACTURER "Lenovo"
-#define MODEL  "Y410P"
-#define VERSION "1.0"
-#define DESCRIPTION "Laptop"
-#define URI "URI"
-#define SERIALNO "123456"
-
 /* Function Prototypes */
 
 /**
  * usb_init()
- * Initializes the USB session
+ * Initializes the USB session and claims the accessory interface
  * Parameters: 
  *   handle - the uninitialized device handle
  * Returns:
  *   0 - if no error occured
- *   1 - if error occurs during initialization
- */
-int usb_init(libusb_device **device, libusb_device_handle *&handle);
-
-/**
- * send_data()
- * Parameters:
- *   handle - the device handle
- *   message - the message string
- *   msg_size - the size of the message string array
- * Returns:
- *   0 - if transfer is successful
- *   1 - if transfer fails
+ *   1 - if error occurs during initialization; handle is NULL and the
+ *       libusb session is closed
  */
-int send_data( libusb_device_handle *handle, unsigned char *message, int msg_size);
+int usb_init(libusb_device_handle *&handle);
 
 /**
  * usb_close()
@@ -101,19 +80,12 @@ int usb_close(libusb_device_handle *handle);
 /**
  * setupAccessory()
  * Parameters:
- *   handle - the handle of the device
+ *   handle - the handle of the device, replaced by the handle of the
+ *            re-enumerated accessory on success
  * Returns:
  *   0 - if successful
  *   1 - if an error occurs during setup
  */
-int setupAccessory(libusb_device_handle *handle);
+int setupAccessory(libusb_device_handle *&handle);
 
-/**
- * unmount_devices()
- * Check if device(s) are mounted by gvfs. If it is, unmount the device(s).
- * Source: http://stackoverflow.com/questions/6383584/check-if-a-directory-is-empty-using-c-on-linux
- * Parameters:
- *   dirname - the directory where the device(s) are unmounted.
- */
-void unmount_devices( const char *dirname );
 #endif /* End Header Guard */
@@ -0,0 +1,357 @@
+/**
+ * config.cpp
+ * UBCST Electrical Division
+ * Runtime configuration of the telemetry program.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "config.h"
+#include "comms.h"
+
+/**
+ * config_defaults()
+ * Returns the compile-time defaults
+ */
+static telemetry_config config_defaults(void)
+{
+    telemetry_config config;
+
+    config.phone_vid = 0x05c6; /* Oneplus One Vendor ID, Nexus 5: 0x18d1 */
+    config.phone_pid = 0x6765; /* Oneplus One Product ID, Nexus 5: 0x4ee2 */
+    config.in_point = 0x81;    /* In point of the Oneplus One */
+    config.out_point = 0x02;   /* Out point of the Oneplus One */
+    config.usb_msg_size = USB_MSG_SIZE;
+
+    config.manufacturer = "Lenovo";
+    config.model = "Y410P";
+    config.version = "1.0";
+    config.description = "Laptop";
+    config.uri = "URI";
+    config.serial = "123456";
+
+    config.gps_path = "/dev/ttyACM0";
+    config.gps_baud = 115200;
+    config.gps_config_path = "gps.conf";
+
+    config.alarm_window = 8;
+    config.alarm_rto_ms = 200;
+    config.alarm_retries = 10;
+
+    config.sensor_rate_hz = 100;
+    config.estimator_rate_hz = 50;
+
+    config.governor = true;
+    config.gov_period_ms = 1000;
+    config.sensor_rate_min = 10;
+    config.estimator_rate_min = 5;
+    config.gps_rate_min = 1;
+    config.cpu_load_low = 50;
+    config.cpu_load_high = 90;
+    config.temp_low_c = 60;
+    config.temp_high_c = 80;
+
+    config.acq_cpu = -1;
+    config.acq_priority = 0;
+    config.usb_cpu = -1;
+    config.usb_priority = 0;
+    config.log_cpu = -1;
+    config.log_priority = 0;
+    config.lock_memory = false;
+
+    config.log_level = LOG_DEBUG;
+
+    return config;
+}
+
+/* The one configuration instance, written only by config_load() */
+static telemetry_config g_config = config_defaults();
+
+static std::string trim(const std::string &s)
+{
+    size_t first = s.find_first_not_of(" \t\r");
+    if(first == std::string::npos)
+	return "";
+
+    size_t last = s.find_last_not_of(" \t\r");
+    return s.substr(first, last - first + 1);
+}
+
+int config_split_line(const std::string &line, std::string &key,
+		      std::string &value)
+{
+    std::string trimmed = trim(line);
+    if(trimmed.empty() || trimmed[0] == '#')
+	return 1;
+
+    size_t eq = trimmed.find('=');
+    if(eq == std::string::npos)
+	return -1;
+
+    key = trim(trimmed.substr(0, eq));
+    value = trim(trimmed.substr(eq + 1));
+    return key.empty() ? -1 : 0;
+}
+
+/**
+ * parse_int()
+ * Parses a decimal or 0x-prefixed integer within [min, max]
+ * Returns:
+ *   0 - if value is a valid integer in range
+ *   1 - otherwise
+ */
+static int parse_int(const std::string &value, long min, long max, long &out)
+{
+    char *end = NULL;
+    long num = strtol(value.c_str(), &end, 0);
+
+    if(value.empty() || *end != '\0' || num < min || num > max)
+	return 1;
+
+    out = num;
+    return 0;
+}
+
+/**
+ * config_set()
+ * Applies one key/value pair
+ * Returns:
+ *   0 - if the key is known and the value valid
+ *   1 - otherwise
+ */
+static int config_set(telemetry_config &config, const std::string &key,
+		      const std::string &value)
+{
+    long num = 0;
+
+    /* String settings */
+    if(key == "manufacturer") config.manufacturer = value;
+    else if(key == "model") config.model = value;
+    else if(key == "version") config.version = value;
+    else if(key == "description") config.description = value;
+    else if(key == "uri") config.uri = value;
+    else if(key == "serial") config.serial = value;
+    else if(key == "gps_path") config.gps_path = value;
+    else if(key == "gps_config") config.gps_config_path = value;
+    else if(key == "log_level" && value == "error") config.log_level = LOG_ERROR;
+    else if(key == "log_level" && value == "info") config.log_level = LOG_INFO;
+    else if(key == "log_level" && value == "debug") config.log_level = LOG_DEBUG;
+
+    /* Numeric settings */
+    else if(key == "phone_vid" && !parse_int(value, 0, 0xFFFF, num))
+	config.phone_vid = num;
+    else if(key == "phone_pid" && !parse_int(value, 0, 0xFFFF, num))
+	config.phone_pid = num;
+    else if(key == "in_point" && !parse_int(value, 0x80, 0x8F, num))
+	config.in_point = num;
+    else if(key == "out_point" && !parse_int(value, 0x00, 0x0F, num))
+	config.out_point = num;
+    else if(key == "usb_msg_size" && !parse_int(value, 16, USB_MSG_SIZE, num))
+	config.usb_msg_size = num;
+    else if(key == "gps_baud" && !parse_int(value, 9600, 115200, num))
+	config.gps_baud = num;
+    else if(key == "alarm_window" && !parse_int(value, 1, 32, num))
+	config.alarm_window = num;
+    else if(key == "alarm_rto_ms" && !parse_int(value, 1, 60000, num))
+	config.alarm_rto_ms = num;
+    else if(key == "alarm_retries" && !parse_int(value, 0, 1000, num))
+	config.alarm_retries = num;
+    else if(key == "sensor_rate_hz" && !parse_int(value, 1, 1000, num))
+	config.sensor_rate_hz = num;
+    else if(key == "estimator_rate_hz" && !parse_int(value, 1, 1000, num))
+	config.estimator_rate_hz = num;
+    else if(key == "governor" && !parse_int(value, 0, 1, num))
+	config.governor = num;
+    else if(key == "gov_period_ms" && !parse_int(value, 10, 60000, num))
+	config.gov_period_ms = num;
+    else if(key == "sensor_rate_min" && !parse_int(value, 1, 1000, num))
+	config.sensor_rate_min = num;
+    else if(key == "estimator_rate_min" && !parse_int(value, 1, 1000, num))
+	config.estimator_rate_min = num;
+    else if(key == "gps_rate_min" && !parse_int(value, 1, 10, num))
+	config.gps_rate_min = num;
+    else if(key == "cpu_load_low" && !parse_int(value, 0, 100, num))
+	config.cpu_load_low = num;
+    else if(key == "cpu_load_high" && !parse_int(value, 0, 100, num))
+	config.cpu_load_high = num;
+    else if(key == "temp_low_c" && !parse_int(value, 0, 150, num))
+	config.temp_low_c = num;
+    else if(key == "temp_high_c" && !parse_int(value, 0, 150, num))
+	config.temp_high_c = num;
+    else if(key == "acq_cpu" && !parse_int(value, -1, CPU_SETSIZE - 1, num))
+	config.acq_cpu = num;
+    else if(key == "acq_priority" && !parse_int(value, 0, 99, num))
+	config.acq_priority = num;
+    else if(key == "usb_cpu" && !parse_int(value, -1, CPU_SETSIZE - 1, num))
+	config.usb_cpu = num;
+    else if(key == "usb_priority" && !parse_int(value, 0, 99, num))
+	config.usb_priority = num;
+    else if(key == "log_cpu" && !parse_int(value, -1, CPU_SETSIZE - 1, num))
+	config.log_cpu = num;
+    else if(key == "log_priority" && !parse_int(value, 0, 99, num))
+	config.log_priority = num;
+    else if(key == "lock_memory" && !parse_int(value, 0, 1, num))
+	config.lock_memory = num;
+    else if(key == "log_level" && !parse_int(value, LOG_ERROR, LOG_DEBUG, num))
+	config.log_level = num;
+    else
+    {
+	std::cout << "Invalid setting: " << key << " = " << value << std::endl;
+	return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * config_read_file()
+ * Applies every setting in a configuration file
+ * Returns:
+ *   0 - if the file was read and every line is valid
+ *   1 - otherwise
+ */
+static int config_read_file(telemetry_config &config, const std::string &path)
+{
+    std::ifstream file(path.c_str());
+    if(!file)
+    {
+	std::cout << "Cannot open config " << path << std::endl;
+	return 1;
+    }
+
+    std::string line, key, value;
+    int lineNum = 0;
+    int status = 0;
+
+    while(getline(file, line))
+    {
+	lineNum++;
+	int result = config_split_line(line, key, value);
+	if(result < 0)
+	{
+	    std::cout << path << ":" << lineNum << ": expected key = value"
+		      << std::endl;
+	    status = 1;
+	}
+	else if(result == 0 && config_set(config, key, value) != 0)
+	{
+	    status = 1;
+	}
+    }
+
+    return status;
+}
+
+static void usage(const char *prog)
+{
+    std::cout << "Usage: " << prog << " [-c file] [--key=value ...]" << std::endl
+	      << "Settings are read from " << CONFIG_PATH
+	      << " unless -c is given; see that file for the keys." << std::endl;
+}
+
+int config_load(int argc, char **argv)
+{
+    telemetry_config config = config_defaults();
+    std::string path = CONFIG_PATH;
+    bool explicitPath = false;
+    int status = 0;
+
+    /* Find the configuration file first so the command line wins */
+    for(int i = 1; i < argc; i++)
+    {
+	if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+	{
+	    usage(argv[0]);
+	    return 1;
+	}
+
+	if(strcmp(argv[i], "-c") == 0)
+	{
+	    if(i + 1 >= argc)
+	    {
+		std::cout << "Missing value for -c" << std::endl;
+		usage(argv[0]);
+		return 1;
+	    }
+
+	    path = argv[++i];
+	    explicitPath = true;
+	}
+    }
+
+    /* The default file is optional, an explicit one is not */
+    if(explicitPath || access(path.c_str(), F_OK) == 0)
+	status |= config_read_file(config, path);
+
+    for(int i = 1; i < argc; i++)
+    {
+	std::string arg = argv[i];
+
+	if(arg == "-c")
+	{
+	    i++;
+	    continue;
+	}
+
+	if(arg.compare(0, 2, "--") != 0)
+	{
+	    std::cout << "Unexpected argument: " << arg << std::endl;
+	    status = 1;
+	    continue;
+	}
+
+	std::string key, value;
+	size_t eq = arg.find('=');
+	if(eq != std::string::npos)
+	{
+	    key = arg.substr(2, eq - 2);
+	    value = arg.substr(eq + 1);
+	}
+	else if(i + 1 < argc)
+	{
+	    key = arg.substr(2);
+	    value = argv[++i];
+	}
+	else
+	{
+	    std::cout << "Missing value for " << arg << std::endl;
+	    status = 1;
+	    continue;
+	}
+
+	/* Accept --gps-path as well as --gps_path */
+	for(size_t c = 0; c < key.size(); c++)
+	    if(key[c] == '-')
+		key[c] = '_';
+
+	status |= config_set(config, key, value);
+    }
+
+    /* Governor ranges must not be empty */
+    if(config.cpu_load_low >= config.cpu_load_high
+       || config.temp_low_c >= config.temp_high_c)
+    {
+	std::cout << "Invalid governor range: need cpu_load_low < cpu_load_high, "
+		  << "temp_low_c < temp_high_c" << std::endl;
+	status = 1;
+    }
+
+    if(status != 0)
+    {
+	usage(argv[0]);
+	return 1;
+    }
+
+    g_config = config;
+    return 0;
+}
+
+const telemetry_config &config_get(void)
+{
+    return g_config;
+}
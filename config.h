@@ -0,0 +1,138 @@
+/**
+ * config.h
+ * UBCST Electrical Division
+ * Runtime configuration of the telemetry program.
+ *
+ * Settings start from the compile-time defaults, are overridden by the
+ * configuration file and then by command-line options, and are frozen
+ * once config_load() returns. Everything else reads them through
+ * config_get(), which needs no locking because nothing writes them
+ * after startup.
+ *
+ * File format: one "key = value" per line, '#' starts a comment line.
+ * Command line: --key=value or --key value, plus -c <file> to choose
+ * the configuration file (default CONFIG_PATH).
+ */
+
+#include <string>
+#include <stdint.h>
+
+/* Header Guard */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/* Configuration file read when -c is not given */
+#define CONFIG_PATH "telemetry.conf"
+
+/* Log levels */
+enum log_level
+{
+    LOG_ERROR = 0,
+    LOG_INFO = 1,
+    LOG_DEBUG = 2
+};
+
+/* Program settings */
+struct telemetry_config
+{
+    /* Phone and accessory endpoints */
+    uint16_t phone_vid;
+    uint16_t phone_pid;
+    unsigned char in_point;
+    unsigned char out_point;
+    int usb_msg_size; /* at most USB_MSG_SIZE */
+
+    /* Accessory identification strings */
+    std::string manufacturer;
+    std::string model;
+    std::string version;
+    std::string description;
+    std::string uri;
+    std::string serial;
+
+    /* GPS */
+    std::string gps_path;
+    int gps_baud;
+    std::string gps_config_path;
+
+    /* Guaranteed-delivery queue for alarms */
+    int alarm_window;
+    int alarm_rto_ms;
+    int alarm_retries;
+
+    /* Sampling rates */
+    int sensor_rate_hz;
+    int estimator_rate_hz;
+
+    /* Adaptive sampling governor: floors for the sample rates and GPS
+     * fix rate, and the CPU load (%) and SoC temperature (C) between
+     * which rates scale from full down to their floors */
+    bool governor;
+    int gov_period_ms;
+    int sensor_rate_min;
+    int estimator_rate_min;
+    int gps_rate_min;
+    int cpu_load_low;
+    int cpu_load_high;
+    int temp_low_c;
+    int temp_high_c;
+
+    /* Real-time scheduling: core (-1 for any) and SCHED_FIFO priority
+     * (0 for normal scheduling) per thread role, and memory locking */
+    int acq_cpu;
+    int acq_priority;
+    int usb_cpu;
+    int usb_priority;
+    int log_cpu;
+    int log_priority;
+    bool lock_memory;
+
+    int log_level;
+};
+
+/**
+ * config_load()
+ * Builds the configuration from defaults, the configuration file and
+ * the command line. Must be called once before any other thread starts.
+ * Parameters:
+ *   argc, argv - the program arguments
+ * Returns:
+ *   0 - if the configuration is valid
+ *   1 - if a value is invalid or help was requested
+ */
+int config_load(int argc, char **argv);
+
+/**
+ * config_get()
+ * Returns:
+ *   the frozen configuration
+ */
+const telemetry_config &config_get(void);
+
+/**
+ * log_enabled()
+ * Returns:
+ *   true - if messages at the given level should be printed
+ */
+inline bool log_enabled(log_level level)
+{
+    return config_get().log_level >= level;
+}
+
+/**
+ * config_split_line()
+ * Splits a configuration file line into key and value, trimming
+ * whitespace on both.
+ * Parameters:
+ *   line - the raw line
+ *   key - the key, on success
+ *   value - the value, on success
+ * Returns:
+ *   0 - if the line holds a key and value
+ *   1 - if the line is blank or a comment
+ *   -1 - if the line is malformed
+ */
+int config_split_line(const std::string &line, std::string &key,
+		      std::string &value);
+
+#endif /* End header guard */
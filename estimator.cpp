@@ -0,0 +1,232 @@
+/**
+ * estimator.cpp
+ * UBCST Electrical Division
+ * Dead-reckoning position estimate between GPS fixes.
+ */
+
+#include <math.h>
+
+#include "estimator.h"
+
+/* Mean Earth radius (m) */
+#define EARTH_RADIUS 6371000.0
+
+#define DEG_TO_RAD (M_PI / 180.0)
+
+/* Initial uncertainty of a freshly initialized filter */
+#define INIT_VEL_VAR 25.0
+
+enum { E = 0, N = 1, VE = 2, VN = 3 };
+
+void est_init(estimator &est, const est_config &config)
+{
+    memset(&est, 0, sizeof(est));
+    est.config = config;
+}
+
+long est_period_us(const estimator &est)
+{
+    if(est.config.rate_hz <= 0)
+	return 1000000L;
+
+    return (long)(1000000.0 / est.config.rate_hz);
+}
+
+double nmea_to_degrees(double value, const std::string &hemisphere)
+{
+    /* gps_parse() stores ddmm.mmmm / 100, i.e. dd.mmmmmm */
+    double degrees = floor(value);
+    double minutes = (value - degrees) * 100.0;
+    double result = degrees + minutes / 60.0;
+
+    if(hemisphere == "S" || hemisphere == "W")
+	result = -result;
+
+    return result;
+}
+
+void est_predict(estimator &est, const sensor_data &sensor, double dt)
+{
+    if(!est.initialized || dt <= 0)
+	return;
+
+    double *x = est.x;
+    double speed = sqrt(x[VE] * x[VE] + x[VN] * x[VN]);
+
+    if(speed >= EST_MIN_HEADING_SPEED)
+    {
+	est.heading = atan2(x[VN], x[VE]);
+	est.heading_known = true;
+    }
+
+    /* Rotate body acceleration onto the tangent plane; with no heading
+     * it would be applied in an arbitrary direction */
+    double ae = 0, an = 0;
+    if(est.heading_known)
+    {
+	double c = cos(est.heading);
+	double s = sin(est.heading);
+	ae = sensor.x * c - sensor.y * s;
+	an = sensor.x * s + sensor.y * c;
+    }
+
+    x[E] += x[VE] * dt + 0.5 * ae * dt * dt;
+    x[N] += x[VN] * dt + 0.5 * an * dt * dt;
+    x[VE] += ae * dt;
+    x[VN] += an * dt;
+
+    /* P = F P F^T with F = [I dt*I; 0 I], done in place */
+    double (*P)[EST_STATES] = est.P;
+    for(int i = 0; i < EST_STATES; i++)
+    {
+	P[E][i] += dt * P[VE][i];
+	P[N][i] += dt * P[VN][i];
+    }
+    for(int i = 0; i < EST_STATES; i++)
+    {
+	P[i][E] += dt * P[i][VE];
+	P[i][N] += dt * P[i][VN];
+    }
+
+    /* Q = q G G^T with G = [dt^2/2, dt] per axis */
+    double q = est.config.accel_noise * est.config.accel_noise;
+    double g0 = 0.5 * dt * dt;
+    double g1 = dt;
+    for(int axis = 0; axis < 2; axis++)
+    {
+	int p = E + axis;
+	int v = VE + axis;
+	P[p][p] += q * g0 * g0;
+	P[p][v] += q * g0 * g1;
+	P[v][p] += q * g0 * g1;
+	P[v][v] += q * g1 * g1;
+    }
+}
+
+void est_update_gps(estimator &est, const gps_data &fix)
+{
+    double lat = nmea_to_degrees(fix.latitude, fix.northsouth);
+    double lon = nmea_to_degrees(fix.longitude, fix.eastwest);
+    double r = est.config.gps_noise * est.config.gps_noise;
+
+    /* Course over ground is only meaningful while moving */
+    if(fix.course >= 0 && fix.speed * EST_KNOTS_TO_MS >= EST_MIN_HEADING_SPEED)
+    {
+	est.heading = (90.0 - fix.course) * DEG_TO_RAD;
+	est.heading_known = true;
+    }
+
+    /* The first fix defines the origin */
+    if(!est.initialized)
+    {
+	est.lat0 = lat;
+	est.lon0 = lon;
+	est.cos_lat0 = cos(lat * DEG_TO_RAD);
+	memset(est.x, 0, sizeof(est.x));
+	memset(est.P, 0, sizeof(est.P));
+	est.P[E][E] = r;
+	est.P[N][N] = r;
+	est.P[VE][VE] = INIT_VEL_VAR;
+	est.P[VN][VN] = INIT_VEL_VAR;
+	est.initialized = true;
+	return;
+    }
+
+    double z[2];
+    z[0] = (lon - est.lon0) * DEG_TO_RAD * EARTH_RADIUS * est.cos_lat0;
+    z[1] = (lat - est.lat0) * DEG_TO_RAD * EARTH_RADIUS;
+
+    double (*P)[EST_STATES] = est.P;
+
+    /* Innovation y = z - H x and S = H P H^T + R with H = [I 0] */
+    double y0 = z[0] - est.x[E];
+    double y1 = z[1] - est.x[N];
+    double s00 = P[E][E] + r;
+    double s01 = P[E][N];
+    double s10 = P[N][E];
+    double s11 = P[N][N] + r;
+    double det = s00 * s11 - s01 * s10;
+    if(fabs(det) < 1e-12)
+	return;
+
+    double i00 = s11 / det;
+    double i01 = -s01 / det;
+    double i10 = -s10 / det;
+    double i11 = s00 / det;
+
+    /* K = P H^T S^-1 */
+    double K[EST_STATES][2];
+    for(int i = 0; i < EST_STATES; i++)
+    {
+	K[i][0] = P[i][E] * i00 + P[i][N] * i10;
+	K[i][1] = P[i][E] * i01 + P[i][N] * i11;
+    }
+
+    for(int i = 0; i < EST_STATES; i++)
+	est.x[i] += K[i][0] * y0 + K[i][1] * y1;
+
+    /* P = (I - K H) P */
+    double HP[2][EST_STATES];
+    for(int j = 0; j < EST_STATES; j++)
+    {
+	HP[0][j] = P[E][j];
+	HP[1][j] = P[N][j];
+    }
+    for(int i = 0; i < EST_STATES; i++)
+	for(int j = 0; j < EST_STATES; j++)
+	    P[i][j] -= K[i][0] * HP[0][j] + K[i][1] * HP[1][j];
+}
+
+void est_update_speed(estimator &est, double speed)
+{
+    if(!est.initialized)
+	return;
+
+    double *x = est.x;
+    double predicted = sqrt(x[VE] * x[VE] + x[VN] * x[VN]);
+    if(predicted < EST_MIN_HEADING_SPEED)
+	return;
+
+    /* Linearize |v| around the current velocity */
+    double h[EST_STATES] = { 0, 0, x[VE] / predicted, x[VN] / predicted };
+    double (*P)[EST_STATES] = est.P;
+
+    double Ph[EST_STATES];
+    double s = est.config.speed_noise * est.config.speed_noise;
+    for(int i = 0; i < EST_STATES; i++)
+    {
+	Ph[i] = P[i][VE] * h[VE] + P[i][VN] * h[VN];
+    }
+    s += h[VE] * Ph[VE] + h[VN] * Ph[VN];
+    if(s < 1e-12)
+	return;
+
+    double y = speed - predicted;
+    for(int i = 0; i < EST_STATES; i++)
+	x[i] += Ph[i] / s * y;
+
+    /* P = P - (P h)(P h)^T / s */
+    for(int i = 0; i < EST_STATES; i++)
+	for(int j = 0; j < EST_STATES; j++)
+	    P[i][j] -= Ph[i] * Ph[j] / s;
+}
+
+int est_output(const estimator &est, est_position &position)
+{
+    if(!est.initialized)
+	return 1;
+
+    const double *x = est.x;
+    position.latitude = est.lat0 + x[N] / EARTH_RADIUS / DEG_TO_RAD;
+    position.longitude = est.lon0
+	+ x[E] / (EARTH_RADIUS * est.cos_lat0) / DEG_TO_RAD;
+    position.speed = sqrt(x[VE] * x[VE] + x[VN] * x[VN]);
+
+    /* Convert from counter-clockwise-from-east to a compass bearing */
+    double bearing = 90.0 - est.heading / DEG_TO_RAD;
+    if(bearing < 0)
+	bearing += 360.0;
+    position.heading = bearing;
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * estimator.h
+ * UBCST Electrical Division
+ * Dead-reckoning position estimate between GPS fixes.
+ *
+ * A four-state Kalman filter (east, north, east velocity, north
+ * velocity in metres on a local tangent plane) is driven by the
+ * accelerometer between fixes and corrected by each GPS fix and by the
+ * speed sensor. All state is fixed-size; nothing is allocated.
+ *
+ * The accelerometer is in the car's frame, so it is only integrated
+ * once the heading is known: from the RMC course of a fix taken while
+ * moving, or from the filter's own velocity.
+ *
+ * Assumed sensor conventions:
+ *   sensor_data.x - longitudinal acceleration, forward positive (m/s^2)
+ *   sensor_data.y - lateral acceleration, left positive (m/s^2)
+ *   sensor_data.speed - ground speed (m/s)
+ */
+
+#include <time.h>
+
+#include "gps.h"
+#include "sensor.h"
+
+/* Header Guard */
+#ifndef ESTIMATOR_H
+#define ESTIMATOR_H
+
+/* Number of filter states */
+#define EST_STATES 4
+
+/* Below this speed (m/s) the heading is held instead of recomputed */
+#define EST_MIN_HEADING_SPEED 0.5
+
+/* Metres per second in a knot */
+#define EST_KNOTS_TO_MS 0.514444
+
+/* Default noise figures for est_config */
+#define EST_ACCEL_NOISE 0.5
+#define EST_GPS_NOISE 3.0
+#define EST_SPEED_NOISE 0.2
+
+/* Filter settings */
+struct est_config
+{
+    double rate_hz;     /* output rate, e.g. 50 */
+    double accel_noise; /* accelerometer noise (m/s^2) */
+    double gps_noise;   /* GPS position noise (m) */
+    double speed_noise; /* speed sensor noise (m/s) */
+};
+
+/* Filter state */
+struct estimator
+{
+    struct est_config config;
+    bool initialized;
+
+    /* Origin of the local tangent plane */
+    double lat0;
+    double lon0;
+    double cos_lat0;
+
+    double heading;     /* radians counter-clockwise from east */
+    bool heading_known; /* false until the car has been seen moving */
+    double x[EST_STATES];
+    double P[EST_STATES][EST_STATES];
+};
+
+/* An estimated position */
+struct est_position
+{
+    double latitude;  /* decimal degrees, north positive */
+    double longitude; /* decimal degrees, east positive */
+    double speed;     /* m/s */
+    double heading;   /* degrees clockwise from north */
+};
+
+/**
+ * est_init()
+ * Resets the filter. The first GPS fix sets the origin.
+ * Parameters:
+ *   est - the filter
+ *   config - the filter settings
+ * Returns:
+ *   None
+ */
+void est_init(estimator &est, const est_config &config);
+
+/**
+ * est_period_us()
+ * Parameters:
+ *   est - the filter
+ * Returns:
+ *   the interval between outputs in microseconds
+ */
+long est_period_us(const estimator &est);
+
+/**
+ * est_predict()
+ * Advances the estimate using the accelerometer reading. Until the
+ * heading is known only the velocity is integrated.
+ * Parameters:
+ *   est - the filter
+ *   sensor - the latest sensor reading
+ *   dt - seconds since the previous prediction
+ * Returns:
+ *   None
+ */
+void est_predict(estimator &est, const sensor_data &sensor, double dt);
+
+/**
+ * est_update_gps()
+ * Corrects the estimate with a GPS fix, and takes the heading from its
+ * course when it reports at least EST_MIN_HEADING_SPEED.
+ * Parameters:
+ *   est - the filter
+ *   fix - a valid fix from gps_parse()
+ * Returns:
+ *   None
+ */
+void est_update_gps(estimator &est, const gps_data &fix);
+
+/**
+ * est_update_speed()
+ * Corrects the estimated velocity with the speed sensor. Ignored until
+ * the heading is known.
+ * Parameters:
+ *   est - the filter
+ *   speed - the measured ground speed (m/s)
+ * Returns:
+ *   None
+ */
+void est_update_speed(estimator &est, double speed);
+
+/**
+ * est_output()
+ * Parameters:
+ *   est - the filter
+ *   position - the current estimate
+ * Returns:
+ *   0 - if the filter has been initialized by a GPS fix
+ *   1 - otherwise
+ */
+int est_output(const estimator &est, est_position &position);
+
+/**
+ * nmea_to_degrees()
+ * Converts a gps_parse() coordinate (ddmm.mmmm / 100) to decimal degrees
+ * Parameters:
+ *   value - the coordinate as stored in gps_data
+ *   hemisphere - "N", "S", "E" or "W"
+ * Returns:
+ *   the signed coordinate in decimal degrees
+ */
+double nmea_to_degrees(double value, const std::string &hemisphere);
+
+#endif /* End header guard */
@@ -0,0 +1,639 @@
+/**
+ * fuzz.cpp
+ * UBCST Electrical Division
+ * Property tests and mutation fuzzing for the input decoders.
+ *
+ * Usage: fuzz [iterations [seed]]
+ * Checks fixed properties of the NMEA checksum, tokenizer, RMC parser,
+ * PMTK builder and reliable delivery (ACK/SACK, retransmission and
+ * recovery from a dropped frame), then feeds random byte streams to
+ * gps_read_line(), mutated sentences to the parser and
+ * mutated ACK and command frames to rely_handle_ack() and
+ * cmd_handle_frame(), checking invariants after every input. Build
+ * with BUILD=sanitize so memory errors abort the run. Exits 1 on the
+ * first violation and prints the input that caused it; rerun with the
+ * printed seed to reproduce.
+ */
+
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gps.h"
+#include "gps_config.h"
+#include "config.h"
+#include "estimator.h"
+#include "reliable.h"
+#include "command.h"
+
+/* Default number of mutated inputs per decoder */
+#define FUZZ_ITERATIONS 100000
+
+/* Largest number of mutations applied to one input */
+#define FUZZ_MAX_MUTATIONS 4
+
+static uint32_t rngState = 1;
+static unsigned long failures = 0;
+
+/* xorshift32: small, fast and identical on every platform */
+static uint32_t rng(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static void print_input(const unsigned char *data, size_t length)
+{
+    for(size_t i = 0; i < length; i++)
+    {
+	if(data[i] >= 0x20 && data[i] < 0x7F)
+	    std::cout << data[i];
+	else
+	{
+	    char hex[8];
+	    snprintf(hex, sizeof(hex), "\\x%02X", data[i]);
+	    std::cout << hex;
+	}
+    }
+    std::cout << std::endl;
+}
+
+/**
+ * fail()
+ * Reports a violated property and the input that caused it
+ */
+static void fail(const char *property, const std::string &input)
+{
+    std::cout << "FAIL: " << property << std::endl << "  input: ";
+    print_input((const unsigned char *)input.data(), input.size());
+    failures++;
+}
+
+/**
+ * mutate()
+ * Applies one to FUZZ_MAX_MUTATIONS random edits to s
+ */
+static void mutate(std::string &s)
+{
+    static const char INTERESTING[] = ",*.$-0959\r\n\0";
+    int count = 1 + rng() % FUZZ_MAX_MUTATIONS;
+
+    for(int m = 0; m < count; m++)
+    {
+	size_t pos = s.empty() ? 0 : rng() % s.size();
+
+	switch(rng() % 7)
+	{
+	case 0: /* flip a bit */
+	    if(!s.empty())
+		s[pos] ^= 1 << (rng() % 8);
+	    break;
+	case 1: /* replace with a delimiter or digit */
+	    if(!s.empty())
+		s[pos] = INTERESTING[rng() % (sizeof(INTERESTING) - 1)];
+	    break;
+	case 2: /* insert a random byte */
+	    s.insert(pos, 1, (char)rng());
+	    break;
+	case 3: /* delete a byte */
+	    if(!s.empty())
+		s.erase(pos, 1);
+	    break;
+	case 4: /* truncate */
+	    s.resize(pos);
+	    break;
+	case 5: /* duplicate a range */
+	    if(!s.empty())
+		s.insert(pos, s.substr(rng() % s.size(), 1 + rng() % 8));
+	    break;
+	default: /* overwrite with a digit */
+	    if(!s.empty())
+		s[pos] = '0' + rng() % 10;
+	    break;
+	}
+    }
+}
+
+/**
+ * with_checksum()
+ * Frames a sentence body as "$<body>*<checksum>"
+ */
+static std::string with_checksum(const std::string &body)
+{
+    char checksum[4];
+    snprintf(checksum, sizeof(checksum), "%02X", nmea_checksum(body));
+    return "$" + body + "*" + checksum;
+}
+
+/**
+ * random_rmc()
+ * Builds a valid RMC body with random coordinates
+ * Returns:
+ *   the body; lat and lon hold the coordinates in decimal degrees
+ */
+static std::string random_rmc(double &lat, double &lon)
+{
+    int latDeg = rng() % 90;
+    int lonDeg = rng() % 180;
+    int latMin = rng() % 600000; /* ten-thousandths of a minute */
+    int lonMin = rng() % 600000;
+    char body[128];
+
+    snprintf(body, sizeof(body),
+	     "GPRMC,%02d%02d%02d.00,A,%02d%02d.%04d,%c,%03d%02d.%04d,%c,"
+	     "%d.%d,%d.%d,191026,,,A",
+	     rng() % 24, rng() % 60, rng() % 60,
+	     latDeg, latMin / 10000, latMin % 10000, (rng() & 1) ? 'N' : 'S',
+	     lonDeg, lonMin / 10000, lonMin % 10000, (rng() & 1) ? 'E' : 'W',
+	     rng() % 100, rng() % 10, rng() % 360, rng() % 10);
+
+    lat = latDeg + latMin / 10000.0 / 60.0;
+    lon = lonDeg + lonMin / 10000.0 / 60.0;
+    return body;
+}
+
+/**
+ * check_fix()
+ * Properties of any fix gps_parse() accepts
+ */
+static void check_fix(const gps_data &data, const std::string &input)
+{
+    double lat = nmea_to_degrees(data.latitude, "N");
+    double lon = nmea_to_degrees(data.longitude, "E");
+
+    if(!(lat >= 0 && lat <= 90) || !(lon >= 0 && lon <= 180))
+	fail("accepted coordinate out of range", input);
+    if(fmod(data.latitude * 100.0 + 1e-9, 100.0) >= 60.0
+       || fmod(data.longitude * 100.0 + 1e-9, 100.0) >= 60.0)
+	fail("accepted minutes of 60 or more", input);
+    if((data.northsouth != "N" && data.northsouth != "S")
+       || (data.eastwest != "E" && data.eastwest != "W"))
+	fail("accepted a bad hemisphere", input);
+    if(data.timeStamp.empty())
+	fail("accepted an empty time", input);
+    if(!(data.speed == -1 || (data.speed >= 0 && data.speed <= 1000))
+       || !(data.course == -1 || (data.course >= 0 && data.course <= 360)))
+	fail("accepted a bad speed or course", input);
+}
+
+/**
+ * test_properties()
+ * Fixed properties of the checksum, parser and command builder
+ */
+static void test_properties(int iterations)
+{
+    gps_data data;
+
+    for(int i = 0; i < iterations; i++)
+    {
+	double lat, lon;
+	std::string body = random_rmc(lat, lon);
+	std::string line = with_checksum(body);
+
+	/* A framed sentence verifies; any one changed body byte does not */
+	if(nmea_verify(line) != 0)
+	    fail("valid sentence rejected by nmea_verify", line);
+
+	std::string corrupt = line;
+	size_t pos = 1 + rng() % body.size();
+	corrupt[pos] ^= 1 + rng() % 0x7F;
+	if(nmea_verify(corrupt) == 0)
+	    fail("single-byte corruption passed nmea_verify", corrupt);
+
+	/* Coordinates survive parsing to within the printed precision */
+	std::vector<std::string> fields = split(line, ',');
+	if(gps_parse(data, fields) != 0)
+	{
+	    fail("valid RMC rejected by gps_parse", line);
+	    continue;
+	}
+	if(fabs(nmea_to_degrees(data.latitude, "N") - lat) > 1e-6
+	   || fabs(nmea_to_degrees(data.longitude, "E") - lon) > 1e-6)
+	    fail("coordinate changed by parsing", line);
+
+	/* Void fixes are never used */
+	fields[2] = "V";
+	if(gps_parse(data, fields) == 0)
+	    fail("void fix accepted", line);
+
+	/* PMTK commands carry a valid checksum and line ending */
+	std::ostringstream args;
+	args << rng() % 10000 << "," << rng() % 6;
+	std::string pmtk = pmtk_build(rng() % 1000, args.str());
+	if(pmtk.size() < 2 || pmtk.compare(pmtk.size() - 2, 2, "\r\n") != 0
+	   || nmea_verify(pmtk.substr(0, pmtk.size() - 2)) != 0)
+	    fail("pmtk_build produced a bad sentence", pmtk);
+    }
+
+    /* Minutes of 60 or more are not coordinates */
+    static const char *BAD_MINUTES[] =
+    {
+	"GPRMC,120000.00,A,4975.0000,N,12300.0000,W,0.0,0.0,191026,,,A",
+	"GPRMC,120000.00,A,4915.0000,N,12360.5000,W,0.0,0.0,191026,,,A",
+	"GPRMC,120000.00,A,0099.9999,N,12300.0000,W,0.0,0.0,191026,,,A"
+    };
+    for(size_t i = 0; i < sizeof(BAD_MINUTES) / sizeof(BAD_MINUTES[0]); i++)
+    {
+	std::string line = with_checksum(BAD_MINUTES[i]);
+	if(gps_parse(data, split(line, ',')) == 0)
+	    fail("minutes of 60 or more accepted", line);
+    }
+}
+
+/**
+ * fuzz_nmea()
+ * Mutated sentences through the checksum, tokenizer and parser. Half
+ * get their checksum recomputed so the parser sees them.
+ */
+static void fuzz_nmea(int iterations)
+{
+    gps_data data;
+
+    for(int i = 0; i < iterations; i++)
+    {
+	double lat, lon;
+	std::string body = random_rmc(lat, lon);
+	std::string line;
+
+	if(rng() & 1)
+	{
+	    mutate(body);
+	    line = with_checksum(body);
+	}
+	else
+	{
+	    line = with_checksum(body);
+	    mutate(line);
+	}
+
+	bool intact = (nmea_verify(line) == 0);
+	std::vector<std::string> fields = split(line, ',');
+
+	data.timeStamp = "";
+	if(gps_parse(data, fields) == 0)
+	{
+	    if(!intact)
+		continue; /* the GPS thread drops these before parsing */
+	    check_fix(data, line);
+	}
+    }
+}
+
+/**
+ * fuzz_read_line()
+ * Random byte streams through gps_read_line() over a pipe, written in
+ * random chunks with line lengths clustered around GPS_BUF_SIZE. Every
+ * line that fits the buffer must come back whole and in order; longer
+ * lines must be dropped entirely.
+ */
+static void fuzz_read_line(int streams)
+{
+    for(int i = 0; i < streams; i++)
+    {
+	int fds[2];
+	if(pipe(fds) != 0)
+	{
+	    fail("pipe failed", "");
+	    return;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	gps_port port;
+	gps_port_init(port, fds[0]);
+
+	/* Lines of any byte but '\n', ending in "\n" or "\r\n" */
+	std::string stream;
+	std::vector<std::string> expected;
+	int lines = 1 + rng() % 12;
+	for(int l = 0; l < lines; l++)
+	{
+	    int length = (rng() & 1) ? rng() % 100
+		: GPS_BUF_SIZE - 4 + rng() % 8;
+	    std::string line;
+	    for(int b = 0; b < length; b++)
+	    {
+		char c = rng();
+		line += (c == '\n' || c == '\r') ? 'x' : c;
+	    }
+
+	    std::string ending = (rng() & 1) ? "\r\n" : "\n";
+	    if((int)(line.size() + ending.size()) <= GPS_BUF_SIZE)
+		expected.push_back(line);
+	    stream += line + ending;
+	}
+
+	/* A trailing partial line is never returned */
+	if(rng() & 1)
+	    stream += "$GPRMC,partial";
+
+	std::vector<std::string> got;
+	std::string line;
+	size_t written = 0;
+	while(written < stream.size())
+	{
+	    size_t chunk = 1 + rng() % (2 * GPS_BUF_SIZE);
+	    if(chunk > stream.size() - written)
+		chunk = stream.size() - written;
+	    if(write(fds[1], stream.data() + written, chunk) != (ssize_t)chunk)
+	    {
+		fail("pipe write failed", "");
+		break;
+	    }
+	    written += chunk;
+
+	    int result;
+	    while((result = gps_read_line(port, line, 0)) == 0)
+		got.push_back(line);
+	    if(result < 0)
+		fail("gps_read_line failed on an open pipe", stream.substr(0, 200));
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+
+	if(got != expected)
+	    fail("gps_read_line lost, split or kept an over-long line",
+		 stream.substr(0, 200));
+    }
+}
+
+/**
+ * check_channels()
+ * Window invariants that must hold after any inbound frame
+ */
+static void check_channels(const rely_session &session, const std::string &input)
+{
+    for(int cls = 0; cls < NUM_MSG_CLASSES; cls++)
+    {
+	const tx_channel &channel = session.channels[cls];
+	int inFlight = (uint16_t)(channel.next_seq - channel.base);
+
+	if(inFlight > channel.config.window)
+	    fail("window overrun", input);
+	if(rely_pending(session, (msg_class)cls) > inFlight)
+	    fail("more frames pending than in flight", input);
+    }
+}
+
+/**
+ * ack_frame()
+ * Builds an ACK for the alarm class somewhere around its window
+ */
+static std::string ack_frame(const rely_session &session)
+{
+    const tx_channel &channel = session.channels[CLASS_ALARM];
+    uint16_t ack = channel.base + rng() % (channel.config.window + 2);
+    uint32_t sack = rng();
+    unsigned char frame[FRAME_HEADER_SIZE + 4] =
+    {
+	FRAME_SYNC, FRAME_ACK, CLASS_ALARM, 0,
+	(unsigned char)(ack & 0xFF), (unsigned char)(ack >> 8), 4, 0,
+	(unsigned char)sack, (unsigned char)(sack >> 8),
+	(unsigned char)(sack >> 16), (unsigned char)(sack >> 24)
+    };
+
+    return std::string((const char *)frame, sizeof(frame));
+}
+
+/**
+ * cmd_frame()
+ * Builds a command frame of a random type with a random payload
+ */
+static std::string cmd_frame(void)
+{
+    int length = rng() % 6;
+    uint16_t id = rng();
+    unsigned char frame[FRAME_HEADER_SIZE + 8] =
+    {
+	FRAME_SYNC, FRAME_CMD, (unsigned char)(rng() % (NUM_CMD_TYPES + 1)), 0,
+	(unsigned char)(id & 0xFF), (unsigned char)(id >> 8),
+	(unsigned char)length, 0
+    };
+
+    for(int i = 0; i < length; i++)
+	frame[FRAME_HEADER_SIZE + i] = rng();
+
+    return std::string((const char *)frame, FRAME_HEADER_SIZE + length);
+}
+
+/* The phone's side of a reliable class: next sequence number expected
+ * and a bitmap of frames received, bit i = expected + i */
+struct phone_rx
+{
+    uint16_t expected;
+    uint64_t received;
+};
+
+/**
+ * phone_receive()
+ * Applies a DATA frame the way the phone does and builds its ACK
+ */
+static std::string phone_receive(phone_rx &rx, const unsigned char *frame)
+{
+    uint16_t seq = frame[4] | (frame[5] << 8);
+
+    /* Everything below the sender's base is delivered or abandoned */
+    if(frame[3] & FRAME_FLAG_BASE)
+    {
+	uint16_t base = frame[FRAME_HEADER_SIZE]
+	    | (frame[FRAME_HEADER_SIZE + 1] << 8);
+	while((int16_t)(rx.expected - base) < 0)
+	{
+	    rx.expected++;
+	    rx.received >>= 1;
+	}
+    }
+
+    uint16_t offset = seq - rx.expected;
+    if(offset < 64)
+	rx.received |= 1ULL << offset;
+    while(rx.received & 1)
+    {
+	rx.expected++;
+	rx.received >>= 1;
+    }
+
+    uint32_t sack = (uint32_t)(rx.received >> 1);
+    unsigned char ack[FRAME_HEADER_SIZE + 4] =
+    {
+	FRAME_SYNC, FRAME_ACK, frame[2], 0,
+	(unsigned char)(rx.expected & 0xFF), (unsigned char)(rx.expected >> 8),
+	4, 0,
+	(unsigned char)sack, (unsigned char)(sack >> 8),
+	(unsigned char)(sack >> 16), (unsigned char)(sack >> 24)
+    };
+
+    return std::string((const char *)ack, sizeof(ack));
+}
+
+static int apply_ack(rely_session &session, const std::string &ack)
+{
+    return rely_handle_ack(session, (const unsigned char *)ack.data(),
+			   ack.size());
+}
+
+/**
+ * test_reliable()
+ * Fixed properties of the alarm class: which slots an ACK frees, when
+ * frames are retransmitted, and that a dropped frame does not stall
+ * the window
+ */
+static void test_reliable(void)
+{
+    rely_session session;
+    tx_channel &channel = session.channels[CLASS_ALARM];
+    class_config config = { true, 8, 20, 100 };
+    unsigned char payload[4] = { 'T', 'E', 'S', 'T' };
+
+    /* Cumulative ACK of 0..1 and SACK of 4 and 6 free exactly those */
+    rely_init(session, NULL);
+    rely_configure(session, CLASS_ALARM, config);
+    for(int i = 0; i < 8; i++)
+	if(rely_send(session, CLASS_ALARM, payload, sizeof(payload)) != 0)
+	    fail("window refused a frame below its size", "send");
+    if(rely_send(session, CLASS_ALARM, payload, sizeof(payload)) == 0)
+	fail("full window accepted a frame", "send");
+
+    unsigned char ack[FRAME_HEADER_SIZE + 4] =
+    {
+	FRAME_SYNC, FRAME_ACK, CLASS_ALARM, 0, 2, 0, 4, 0,
+	(1 << 1) | (1 << 3), 0, 0, 0
+    };
+    std::string input((const char *)ack, sizeof(ack));
+    apply_ack(session, input);
+    for(uint16_t seq = 0; seq < 8; seq++)
+    {
+	bool freed = (seq < 2 || seq == 4 || seq == 6);
+	const tx_slot &slot = channel.slots[seq % RELY_WINDOW_MAX];
+	bool held = slot.in_use && slot.seq == seq && !slot.acked;
+	if(held == freed)
+	    fail("ACK freed the wrong slots", input);
+    }
+    if(channel.base != 2 || rely_pending(session, CLASS_ALARM) != 4)
+	fail("ACK left the wrong base or pending count", input);
+
+    /* Retransmission only after the RTO, flagged and counted */
+    rely_poll(session, 0);
+    if(channel.retransmits != 0)
+	fail("frame retransmitted before its RTO", "poll");
+    usleep((config.rto_ms + 5) * 1000);
+    rely_poll(session, 0);
+    if(channel.retransmits != 4)
+	fail("unacknowledged frames not retransmitted after the RTO", "poll");
+    if(!(channel.slots[3].frame[3] & FRAME_FLAG_RETX)
+       || (channel.slots[4].frame[3] & FRAME_FLAG_RETX))
+	fail("retransmission flagged on the wrong frames", "poll");
+
+    /* A frame dropped after max_retries must not stall the window: lose
+     * frame 0, deliver 1..40, and everything is acknowledged */
+    config.rto_ms = 5;
+    config.max_retries = 0;
+    rely_init(session, NULL);
+    rely_configure(session, CLASS_ALARM, config);
+    phone_rx rx = { 0, 0 };
+
+    for(int sent = 0; sent < 41; )
+    {
+	uint16_t seq = channel.next_seq;
+	if(rely_send(session, CLASS_ALARM, payload, sizeof(payload)) != 0)
+	{
+	    /* Window full: wait for the lost frame to be dropped */
+	    usleep((config.rto_ms + 1) * 1000);
+	    if(rely_poll(session, 0) != 0 || channel.dropped > 1)
+		fail("delivered frames dropped", "poll");
+	    if(channel.dropped == 0)
+	    {
+		fail("window stalled without dropping the lost frame", "poll");
+		break;
+	    }
+	    continue;
+	}
+
+	const tx_slot &slot = channel.slots[seq % RELY_WINDOW_MAX];
+	if(seq != 0)
+	    apply_ack(session, phone_receive(rx, slot.frame));
+	sent++;
+    }
+    if(channel.dropped != 1 || rely_pending(session, CLASS_ALARM) != 0
+       || channel.base != 41 || rx.expected != 41)
+	fail("window did not recover from a dropped frame", "drop seq 0");
+}
+
+/**
+ * fuzz_frames()
+ * Mutated ACK and command frames through both decoders. Command
+ * replies queue frames on the alarm class, which the ACKs then clear.
+ */
+static void fuzz_frames(int iterations)
+{
+    rely_session session;
+    rely_init(session, NULL);
+    cmd_init();
+
+    for(int i = 0; i < iterations; i++)
+    {
+	bool ack = rng() & 1;
+	std::string input = ack ? ack_frame(session) : cmd_frame();
+	if(rng() % 4 != 0)
+	    mutate(input);
+
+	/* Exact-size copy so reads past the end are caught */
+	std::vector<unsigned char> frame(input.begin(), input.end());
+	const unsigned char *data = frame.empty() ? NULL : &frame[0];
+
+	if(ack)
+	    rely_handle_ack(session, data, frame.size());
+	else
+	    cmd_handle_frame(session, data, frame.size());
+
+	check_channels(session, input);
+
+	for(int s = 0; s < NUM_STREAMS; s++)
+	{
+	    int rate = cmd_sample_rate((cmd_stream)s);
+	    if(rate < 1 || rate > CMD_MAX_SAMPLE_RATE)
+		fail("sample rate out of range", input);
+	}
+
+	int gpsRate = cmd_gps_rate();
+	if(gpsRate < 0 || gpsRate > 10)
+	    fail("GPS rate out of range", input);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : FUZZ_ITERATIONS;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : (uint32_t)time(NULL);
+    if(iterations <= 0 || seed == 0)
+    {
+	std::cout << "Usage: fuzz [iterations [seed]]" << std::endl;
+	return 1;
+    }
+
+    char prog[] = "fuzz";
+    char quiet[] = "--log_level=error";
+    char *configArgs[] = { prog, quiet };
+    config_load(2, configArgs);
+
+    rngState = seed;
+    std::cout << "fuzz: " << iterations << " iterations, seed " << seed
+	      << std::endl;
+
+    test_properties(iterations / 10 + 1);
+    test_reliable();
+    fuzz_read_line(iterations / 100 + 1);
+    fuzz_nmea(iterations);
+    fuzz_frames(iterations);
+
+    if(failures > 0)
+    {
+	std::cout << "fuzz: " << failures << " failures" << std::endl;
+	return 1;
+    }
+
+    std::cout << "fuzz: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,306 @@
+/**
+ * governor.cpp
+ * UBCST Electrical Division
+ * Power- and thermal-aware sampling governor.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "governor.h"
+#include "config.h"
+#include "runtime.h"
+
+/* Link state reported by the USB thread */
+static std::atomic<int> linkPending(0);
+static std::atomic<int> linkWindow(0);
+static std::atomic<unsigned long> linkRetransmits(0);
+static std::atomic<unsigned long> linkSent(0);
+static std::atomic<unsigned long> linkDropped(0);
+
+/* Smoothed headroom in thousandths, read by the sampling threads */
+static std::atomic<int> headroomMilli(1000);
+
+/* The same, updated at most once per GOV_GPS_HOLD_MS for the GPS */
+static std::atomic<int> gpsHeadroomMilli(1000);
+
+/* Governor thread; stopping is signalled through the condition so the
+ * thread never has to poll for it */
+static pthread_t govThread;
+static pthread_mutex_t govLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t govWake;
+static bool govStop = false;
+static bool govRunning = false;
+
+/* CPU time from the aggregate line of /proc/stat (jiffies) */
+struct cpu_times
+{
+    unsigned long long busy;
+    unsigned long long total;
+};
+
+/**
+ * read_cpu_times()
+ * Returns:
+ *   0 - if /proc/stat was read
+ *   1 - otherwise
+ */
+static int read_cpu_times(cpu_times &times)
+{
+    std::ifstream file("/proc/stat");
+    std::string cpu;
+    unsigned long long user = 0, nice = 0, system = 0, idle = 0;
+    unsigned long long iowait = 0, irq = 0, softirq = 0, steal = 0;
+
+    if(!(file >> cpu >> user >> nice >> system >> idle >> iowait >> irq
+	 >> softirq >> steal) || cpu != "cpu")
+	return 1;
+
+    times.busy = user + nice + system + irq + softirq + steal;
+    times.total = times.busy + idle + iowait;
+    return 0;
+}
+
+/**
+ * read_temp_c()
+ * Returns:
+ *   the SoC temperature in degrees C, or -1 if no sensor can be read
+ */
+static int read_temp_c(void)
+{
+    std::ifstream file(GOV_THERMAL_PATH);
+    long milliC = 0;
+
+    if(!(file >> milliC))
+	return -1;
+
+    return milliC / 1000;
+}
+
+/**
+ * falloff()
+ * Returns:
+ *   1 at or below low, 0 at or above high, linear in between
+ */
+static double falloff(double value, double low, double high)
+{
+    if(value <= low)
+	return 1.0;
+    if(value >= high)
+	return 0.0;
+    return (high - value) / (high - low);
+}
+
+static void add_ms(struct timespec &t, long ms)
+{
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (ms % 1000) * 1000000L;
+    if(t.tv_nsec >= 1000000000L)
+    {
+	t.tv_nsec -= 1000000000L;
+	t.tv_sec++;
+    }
+}
+
+/**
+ * governor_run()
+ * The governor thread: samples the inputs once per period and publishes
+ * the smoothed headroom
+ */
+static void *governor_run(void *)
+{
+    const telemetry_config &config = config_get();
+    cpu_times last, now;
+    bool haveCpu = (read_cpu_times(last) == 0);
+    unsigned long lastRetransmits = linkRetransmits.load();
+    unsigned long lastSent = linkSent.load();
+    unsigned long lastDropped = linkDropped.load();
+    double smoothed = 1.0;
+    long sinceGpsChange = 0;
+    struct timespec deadline;
+
+    rt_setup_thread(RT_LOGGING);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&govLock);
+    while(!govStop)
+    {
+	/* Sleep until the next period or until governor_stop() */
+	add_ms(deadline, config.gov_period_ms);
+	while(!govStop && pthread_cond_timedwait(&govWake, &govLock, &deadline)
+	      != ETIMEDOUT)
+	    ;
+	if(govStop)
+	    break;
+	pthread_mutex_unlock(&govLock);
+
+	/* CPU: share of busy time since the last period */
+	double cpuLoad = 0;
+	if(read_cpu_times(now) == 0)
+	{
+	    if(haveCpu && now.total > last.total)
+		cpuLoad = 100.0 * (now.busy - last.busy) / (now.total - last.total);
+	    last = now;
+	    haveCpu = true;
+	}
+	double cpuScore = falloff(cpuLoad, config.cpu_load_low,
+				  config.cpu_load_high);
+
+	/* Thermal: no sensor means no constraint */
+	int temp = read_temp_c();
+	double tempScore = (temp < 0) ? 1.0
+	    : falloff(temp, config.temp_low_c, config.temp_high_c);
+
+	/* Link: free share of the alarm window, halved while retransmitting */
+	int pending = linkPending.load(std::memory_order_relaxed);
+	int window = linkWindow.load(std::memory_order_relaxed);
+	unsigned long retransmits = linkRetransmits.load(std::memory_order_relaxed);
+	double linkScore = (window > 0) ? 1.0 - (double)pending / window : 1.0;
+	if(retransmits != lastRetransmits && linkScore > 0.5)
+	    linkScore = 0.5;
+	lastRetransmits = retransmits;
+
+	/* Telemetry: halved on any failed write, lower as more are lost */
+	unsigned long sent = linkSent.load(std::memory_order_relaxed);
+	unsigned long dropped = linkDropped.load(std::memory_order_relaxed);
+	double lossScore = 1.0;
+	if(dropped != lastDropped && sent != lastSent)
+	{
+	    lossScore = 1.0 - (double)(dropped - lastDropped) / (sent - lastSent);
+	    if(lossScore > 0.5)
+		lossScore = 0.5;
+	}
+	if(lossScore < linkScore)
+	    linkScore = lossScore;
+	lastSent = sent;
+	lastDropped = dropped;
+
+	/* The tightest constraint wins; smoothing keeps rates from
+	 * following every spike */
+	double headroom = cpuScore;
+	if(tempScore < headroom)
+	    headroom = tempScore;
+	if(linkScore < headroom)
+	    headroom = linkScore;
+	if(headroom < 0)
+	    headroom = 0;
+
+	smoothed += GOV_SMOOTHING * (headroom - smoothed);
+	headroomMilli.store((int)(smoothed * 1000 + 0.5), std::memory_order_relaxed);
+
+	/* GPS rate changes cost a PMTK exchange, so hold each one */
+	sinceGpsChange += config.gov_period_ms;
+	if(sinceGpsChange >= GOV_GPS_HOLD_MS)
+	{
+	    gpsHeadroomMilli.store(headroomMilli.load(std::memory_order_relaxed),
+				   std::memory_order_relaxed);
+	    sinceGpsChange = 0;
+	}
+
+	if(log_enabled(LOG_DEBUG))
+	    std::cout << "Governor: cpu " << (int)cpuLoad << "%, temp " << temp
+		      << " C, queue " << pending << "/" << window << ", link "
+		      << (int)(linkScore * 100) << "%"
+		      << ", headroom " << (int)(smoothed * 100) << "%, estimator "
+		      << gov_sample_rate(STREAM_ESTIMATOR) << " Hz, GPS headroom "
+		      << gpsHeadroomMilli.load(std::memory_order_relaxed) / 10
+		      << "%" << std::endl;
+
+	pthread_mutex_lock(&govLock);
+    }
+    pthread_mutex_unlock(&govLock);
+
+    return NULL;
+}
+
+int governor_start(void)
+{
+    if(!config_get().governor || govRunning)
+	return 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&govWake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    govStop = false;
+    headroomMilli.store(1000);
+    gpsHeadroomMilli.store(1000);
+
+    /* Not pinned or prioritized like the thread that starts it */
+    if(rt_thread_create(govThread, governor_run, NULL) != 0)
+    {
+	std::cout << "Cannot start governor" << std::endl;
+	pthread_cond_destroy(&govWake);
+	return 1;
+    }
+
+    govRunning = true;
+    return 0;
+}
+
+void governor_stop(void)
+{
+    if(!govRunning)
+	return;
+
+    pthread_mutex_lock(&govLock);
+    govStop = true;
+    pthread_cond_signal(&govWake);
+    pthread_mutex_unlock(&govLock);
+
+    pthread_join(govThread, NULL);
+    pthread_cond_destroy(&govWake);
+    govRunning = false;
+
+    /* Streams go back to the rates the phone asked for */
+    headroomMilli.store(1000);
+    gpsHeadroomMilli.store(1000);
+}
+
+void gov_report_link(int pending, int window, unsigned long retransmits,
+		     unsigned long sent, unsigned long dropped)
+{
+    linkPending.store(pending, std::memory_order_relaxed);
+    linkWindow.store(window, std::memory_order_relaxed);
+    linkRetransmits.store(retransmits, std::memory_order_relaxed);
+    linkSent.store(sent, std::memory_order_relaxed);
+    linkDropped.store(dropped, std::memory_order_relaxed);
+}
+
+int gov_sample_rate(cmd_stream stream)
+{
+    const telemetry_config &config = config_get();
+    int requested = cmd_sample_rate(stream);
+    int floor = (stream == STREAM_SENSOR) ? config.sensor_rate_min
+	: config.estimator_rate_min;
+
+    /* Never raise a rate the phone lowered below the floor */
+    if(requested <= floor)
+	return requested;
+
+    int headroom = headroomMilli.load(std::memory_order_relaxed);
+    return floor + (requested - floor) * headroom / 1000;
+}
+
+int gov_gps_rate(int ceiling)
+{
+    int floor = config_get().gps_rate_min;
+
+    if(ceiling <= floor)
+	return ceiling;
+
+    int headroom = gpsHeadroomMilli.load(std::memory_order_relaxed);
+    return floor + (ceiling - floor) * headroom / 1000;
+}
+
+int gov_headroom(void)
+{
+    return headroomMilli.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,95 @@
+/**
+ * governor.h
+ * UBCST Electrical Division
+ * Power- and thermal-aware sampling governor.
+ *
+ * A background thread wakes every gov_period_ms (blocking, never
+ * spinning) and measures CPU utilization (/proc/stat), SoC temperature
+ * (/sys/class/thermal) and the state of the USB link reported by the
+ * USB thread: the alarm queue, retransmissions and telemetry frames
+ * lost to failed writes. The worst of these gives a headroom between 0
+ * and 1, smoothed over a few periods, which scales:
+ *   - the sensor and estimator sample rates, between the configured
+ *     minimum and the rate the phone asked for (cmd_sample_rate()),
+ *   - the GPS fix rate, between gps_rate_min and a ceiling chosen by
+ *     the GPS thread, changing at most once per GOV_GPS_HOLD_MS,
+ *   - the USB loop period, which main.cpp stretches as headroom falls.
+ * The estimator and GPS threads apply these rates; the sensor rate
+ * waits for sensor.cpp to sample hardware.
+ */
+
+#include "command.h"
+
+/* Header Guard */
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+/* Temperature sensor of the SoC */
+#define GOV_THERMAL_PATH "/sys/class/thermal/thermal_zone0/temp"
+
+/* Weight of the newest headroom sample in the smoothed value */
+#define GOV_SMOOTHING 0.3
+
+/* Minimum time between GPS fix rate changes (ms) */
+#define GOV_GPS_HOLD_MS 5000
+
+/**
+ * governor_start()
+ * Starts the governor thread if the governor is enabled.
+ * Returns:
+ *   0 - if the governor is running or disabled
+ *   1 - if the thread could not be started
+ */
+int governor_start(void);
+
+/**
+ * governor_stop()
+ * Stops the governor thread and waits for it to exit.
+ * Returns:
+ *   None
+ */
+void governor_stop(void);
+
+/**
+ * gov_report_link()
+ * Reports the state of the USB link. Called by the USB thread after
+ * each poll.
+ * Parameters:
+ *   pending - alarm frames waiting for an ACK
+ *   window - the window those frames occupy
+ *   retransmits - total alarm retransmissions so far
+ *   sent - total telemetry frames sent so far
+ *   dropped - total telemetry frames lost to failed writes so far
+ * Returns:
+ *   None
+ */
+void gov_report_link(int pending, int window, unsigned long retransmits,
+		     unsigned long sent, unsigned long dropped);
+
+/**
+ * gov_sample_rate()
+ * Parameters:
+ *   stream - the stream
+ * Returns:
+ *   the rate the stream should sample at now (Hz)
+ */
+int gov_sample_rate(cmd_stream stream);
+
+/**
+ * gov_gps_rate()
+ * Parameters:
+ *   ceiling - the highest rate wanted: the phone's request or the
+ *     configured rate, within what the baud rate can carry
+ * Returns:
+ *   the fix rate the GPS should run at now (Hz), at most ceiling
+ */
+int gov_gps_rate(int ceiling);
+
+/**
+ * gov_headroom()
+ * Returns:
+ *   the smoothed headroom, 0 (none) to 1 (full), in thousandths
+ */
+int gov_headroom(void);
+
+#endif /* End header guard */
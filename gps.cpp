@@ -8,7 +8,10 @@
  * http://stackoverflow.com/questions/18108932/linux-c-serial-port-reading-writing
  */
 
+#include <math.h>
+
 #include "gps.h"
+#include "config.h"
 
 /**
  * Code to split a string. Taken from:
@@ -36,17 +39,19 @@ std::vector<std::string> split( const std::string &s, char delim ) {
 /**
  * gps_init()
  * Parameters: usb_path - the path of the GPS USB port
- * Returns: USB - the USB port to read GPS data from
+ *             baud - the baud rate of the port
+ * Returns: USB - the USB port to read GPS data from, -1 on failure
  */
-int gps_init(std::string usb_path)
+int gps_init(std::string usb_path, int baud)
 {
    /* Open file descriptor */
-int USB = open( usb_path.c_str() , O_RDWR | O_NOCTTY );
+   int USB = open( usb_path.c_str() , O_RDWR | O_NOCTTY | O_NONBLOCK );
 
    /* Error handling */
    if ( USB < 0 ) {
        std::cout << "Error " << errno << " opening " << usb_path << ": " \
 		 << strerror( errno ) << std::endl;
+       return -1;
    }
 
    /* Configure port */
@@ -57,11 +62,22 @@ int USB = open( usb_path.c_str() , O_RDWR | O_NOCTTY );
    if( tcgetattr( USB, &tty ) != 0 ) {
        std::cout << "Error " << errno << " from tcgetattr: " <<	\
 	   strerror( errno ) << std::endl;
+       close( USB );
+       return -1;
    }
 
+   /* Make raw first so the settings below are not overwritten */
+   cfmakeraw( &tty );
+
    /* Set baud rate speed */
-   cfsetospeed( &tty, (speed_t)B115200 );
-   cfsetispeed( &tty, (speed_t)B115200 );
+   speed_t speed = gps_baud_speed( baud );
+   if ( speed == 0 ) {
+       std::cout << "Unsupported baud rate " << baud << std::endl;
+       close( USB );
+       return -1;
+   }
+   cfsetospeed( &tty, speed );
+   cfsetispeed( &tty, speed );
 
    /* Set other port stuff */
    tty.c_cflag &= ~PARENB;
@@ -70,124 +86,300 @@ int USB = open( usb_path.c_str() , O_RDWR | O_NOCTTY );
    tty.c_cflag |= CS8;
 
    tty.c_cflag &= ~CRTSCTS;
-   tty.c_cc[VMIN] = 1;
-   tty.c_cc[VTIME] = 5;
    tty.c_cflag |= CREAD | CLOCAL;
 
-   /* Make raw */
-   cfmakeraw( &tty );
+   /* Reads return whatever is buffered; poll() does the waiting */
+   tty.c_cc[VMIN] = 0;
+   tty.c_cc[VTIME] = 0;
 
    /* Flush port, then apply attributes */
    tcflush( USB, TCIFLUSH );
    if( tcsetattr( USB, TCSANOW, &tty ) != 0 ) {
        std::cout << "Error " << errno << " from tcsetattr" << std::endl;
+       close( USB );
+       return -1;
+   }
+
+   /* Ask the driver to push bytes up immediately instead of batching.
+    * USB CDC ports do not support this, so failure is not an error. */
+   struct serial_struct serial;
+   if( ioctl( USB, TIOCGSERIAL, &serial ) == 0 ) {
+       serial.flags |= ASYNC_LOW_LATENCY;
+       if( ioctl( USB, TIOCSSERIAL, &serial ) != 0 ) {
+	   std::cout << "Low latency mode not set: " << strerror( errno ) \
+		     << std::endl;
+       }
    }
 
    return USB;
 }
 
-void gps_write(int USB)
+void gps_port_init(gps_port &port, int USB)
 {
-   /**
-    * Write configuration logic (used to configure the GPS update rate).
-    * The GPS uses the PMTK protocol to control and change
-    * various attributes and settings.
-    * Documentation for this protocol can be found:
-    * https://www.adafruit.com/datasheets/PMTK_A08.pdf
-    * http://www.adafruit.com/datasheets/PMTK_A11.pdf
-    *
-    * Part of the PMTK message is the checksum field. Use this website
-    * to compute the checksum: http://www.hhhh.org/wiml/proj/nmeaxor.html
-    */
-   const char *str;
-
-   // Not sure if we need to do a full cold start or not. Commenting
-   // out for now.
-   /*// Perform full cold start
-   str = "$PMTK104*37\r\n";
-   cout << "Write Val: " << write( USB, str, strlen( str ) ) << endl;*/
-
-   // Only receive GPSRMC messages
-   str = "$PMTK314,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0*29\r\n";
-   std::cout << "PMTK String: " << str;
-   if ( strlen( str ) != write( USB, str, strlen( str ) ) ) {
-       std::cout << "Read only GPSRMC messages failed." << std::endl;
-   }
-
-   // Turn off the EASY function because it only works for 1Hz.
-   // Not 100% sure if this is necessary. Leaving in for now.
-   str = "$PMTK869,1,0*34\r\n";
-   std::cout << "PMTK String: " << str;
-   if ( strlen( str ) != write( USB, str, strlen( str ) ) ) {
-       std::cout << "Turn off EASY function failed." << std::endl;
-   }
-
-   // Change update rate to 5Hz.
-   str = "$PMTK220,200*2C\r\n";
-   std::cout << "PMTK String: " << str;
-   if ( strlen( str ) != write( USB, str, strlen( str ) ) ) {
-       std::cout << "Change update rate to 5Hz failed." << std::endl;
-   }
+   memset( &port, 0, sizeof port );
+   port.fd = USB;
 }
 
-std::vector<std::string> gps_read(int USB)
+/**
+ * ms_until()
+ * Returns the milliseconds left before a monotonic deadline
+ */
+static long ms_until( const struct timespec &deadline )
 {
-   /* Read the GPS NMEA messages */
-   int n = 0,
-       spot = 0;
-   char buf = '\0';
+   struct timespec now;
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return ( deadline.tv_sec - now.tv_sec ) * 1000L \
+      + ( deadline.tv_nsec - now.tv_nsec ) / 1000000L;
+}
 
-   char response[1024];
-   memset( response, '\0', sizeof( response ) );
+int gps_read_line(gps_port &port, std::string &line, int timeout_ms)
+{
+   struct timespec now;
+   struct timespec deadline;
 
-      spot = 0;
-      /* Read a NMEA line */
-      do {
-         n = read( USB, &buf, 1 );
-         if ( buf == '\n' ) {
-            continue;
-         }
-         sprintf( &response[spot], "%c", buf );
-         spot += n;
-      } while( buf != '\r' && n > 0 );
+   /* The timeout covers the whole call, not each wait */
+   clock_gettime( CLOCK_MONOTONIC, &deadline );
+   if ( timeout_ms > 0 ) {
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_nsec += ( timeout_ms % 1000 ) * 1000000L;
+      if ( deadline.tv_nsec >= 1000000000L ) {
+	 deadline.tv_sec++;
+	 deadline.tv_nsec -= 1000000000L;
+      }
+   }
 
-      // Split the string based on the comma delimiter
-      std::string resp( response );
-      std::vector<std::string> nmeaLine = split( resp, ',' );
+   while( true ) {
+      /* Hand out a complete sentence if one is buffered */
+      char *begin = &port.buf[port.start];
+      char *newline = (char *)memchr( begin, '\n', port.end - port.start );
+      if ( newline != NULL && port.discarding ) {
+	 /* End of a runaway line; the next sentence starts after it */
+	 port.start = newline + 1 - port.buf;
+	 port.pending = port.last_read;
+	 port.discarding = false;
+	 continue;
+      }
+      if ( newline != NULL ) {
+	 int length = newline - begin;
+	 if ( length > 0 && begin[length - 1] == '\r' ) {
+	    length--;
+	 }
+	 line.assign( begin, length );
+	 port.arrival = port.pending;
+	 port.start = newline + 1 - port.buf;
 
-      // Check if read line is a PMTK message
-      std::string prefix = "$PMTK";
-      if ( !nmeaLine.at(0).compare( 0, prefix.size(), prefix ) ) {
-	  std::cout << "PMTK message: " << response << std::endl;
+	 /* Only the latest read can hold bytes past a complete line */
+	 port.pending = port.last_read;
+	 return 0;
       }
 
-      // Check if number of values in the nmeaLine is the number of
-      // values we expect the GPSRMC message to have.
-      else if ( nmeaLine.size() < 12 ) {
-	  std::cout << "Too few elements: " << response << std::endl;
+      /* Compact, and drop a runaway line that fills the buffer until
+       * its newline arrives */
+      if ( port.discarding ) {
+	 port.start = 0;
+	 port.end = 0;
+      }
+      else if ( port.start > 0 ) {
+	 memmove( port.buf, &port.buf[port.start], port.end - port.start );
+	 port.end -= port.start;
+	 port.start = 0;
+      }
+      if ( port.end == GPS_BUF_SIZE ) {
+	 if ( log_enabled( LOG_INFO ) ) {
+	    std::cout << "NMEA line too long, discarding" << std::endl;
+	 }
+	 port.end = 0;
+	 port.discarding = true;
       }
 
-      // Check if the NMEA line is valid
-      else if ( nmeaLine.at( 2 ) == "V" ) {
-	  std::cout << "Invalid message: " << response << std::endl;
+      /* Wait for the next burst, at most until the deadline */
+      int wait = -1;
+      if ( timeout_ms >= 0 ) {
+	 long remaining = ms_until( deadline );
+	 wait = remaining > 0 ? (int)remaining : 0;
       }
 
-      return nmeaLine;
+      struct pollfd pfd;
+      pfd.fd = port.fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      int ready = poll( &pfd, 1, wait );
+      if ( ready < 0 ) {
+	 if ( errno == EINTR ) {
+	    continue;
+	 }
+	 std::cout << "Error " << errno << " from poll: " \
+		   << strerror( errno ) << std::endl;
+	 return -1;
+      }
+      if ( ready == 0 ) {
+	 return 1;
+      }
+      if ( pfd.revents & ( POLLERR | POLLNVAL ) ) {
+	 std::cout << "GPS port error" << std::endl;
+	 return -1;
+      }
+
+      int n = read( port.fd, &port.buf[port.end], GPS_BUF_SIZE - port.end );
+      if ( n < 0 && ( errno == EAGAIN || errno == EINTR ) ) {
+	 continue;
+      }
+      if ( n < 0 ) {
+	 std::cout << "Error " << errno << " reading GPS: " \
+		   << strerror( errno ) << std::endl;
+	 return -1;
+      }
+      if ( n == 0 ) {
+	 /* Readable with nothing to read: the receiver was unplugged */
+	 std::cout << "GPS port closed" << ( ( pfd.revents & POLLHUP ) ? \
+					     " (hangup)" : "" ) << std::endl;
+	 return -1;
+      }
+
+      clock_gettime( CLOCK_MONOTONIC, &now );
+      if ( port.end == 0 ) {
+	 port.pending = now;
+      }
+      port.end += n;
+      port.last_read = now;
+   }
+}
+
+speed_t gps_baud_speed(int baud)
+{
+   switch ( baud ) {
+   case 9600: return B9600;
+   case 19200: return B19200;
+   case 38400: return B38400;
+   case 57600: return B57600;
+   case 115200: return B115200;
+   default: return 0;
+   }
+}
+
+int gps_set_baud(int USB, int baud)
+{
+   speed_t speed = gps_baud_speed( baud );
+   struct termios tty;
+
+   if ( speed == 0 || tcgetattr( USB, &tty ) != 0 ) {
+      std::cout << "Cannot set baud rate " << baud << std::endl;
+      return 1;
+   }
+
+   cfsetospeed( &tty, speed );
+   cfsetispeed( &tty, speed );
+
+   /* Bytes received at the old rate are garbage at the new one */
+   tcflush( USB, TCIFLUSH );
+   if( tcsetattr( USB, TCSANOW, &tty ) != 0 ) {
+       std::cout << "Error " << errno << " from tcsetattr" << std::endl;
+       return 1;
+   }
+
+   return 0;
 }
 
-struct gps_data gps_parse(gps_data data, std::vector<std::string> nmeaLine)
+uint8_t nmea_checksum(const std::string &body)
+{
+   uint8_t sum = 0;
+   for ( size_t i = 0; i < body.size(); i++ ) {
+      sum ^= (uint8_t)body[i];
+   }
+   return sum;
+}
+
+int nmea_verify(const std::string &line)
+{
+   size_t star = line.rfind( '*' );
+   if ( line.size() < 4 || line[0] != '$' || star == std::string::npos \
+	|| star + 3 != line.size() \
+	|| !isxdigit( (unsigned char)line[star + 1] ) \
+	|| !isxdigit( (unsigned char)line[star + 2] ) ) {
+      return 1;
+   }
+
+   unsigned long sum = strtoul( line.substr( star + 1, 2 ).c_str(), NULL, 16 );
+   return sum == nmea_checksum( line.substr( 1, star - 1 ) ) ? 0 : 1;
+}
+
+/**
+ * parse_coordinate()
+ * Parses a ddmm.mmmm field. Fails on empty or trailing characters and
+ * on minutes of 60 or more.
+ */
+static int parse_coordinate( const std::string &field, double max, double &value )
 {
-      // Print out response message
-      data.timeStamp = nmeaLine.at(1);
-      data.latitude = atof( nmeaLine.at(3).c_str() ) / 100.00;
-      data.northsouth = nmeaLine.at(4);
-      data.longitude = atof( nmeaLine.at(5).c_str() ) / 100.00;
-      data.eastwest = nmeaLine.at(6);
-      std::cout << "Timestamp: " << data.timeStamp << " Latitude: " 
-		<< data.latitude << data.northsouth 
-		<< " Longitude: " << data.longitude << data.eastwest << std::endl;
-
-      return data;
+   char *end = NULL;
+   double num = strtod( field.c_str(), &end );
+   if ( field.empty() || *end != '\0' || !( num >= 0 && num <= max ) \
+	|| fmod( num, 100.0 ) >= 60.0 ) {
+      return 1;
+   }
+   value = num;
+   return 0;
+}
+
+/**
+ * parse_optional()
+ * Parses a speed or course field, which receivers leave empty when they
+ * have no motion solution. Fails on trailing characters or a value
+ * outside [0, max].
+ */
+static int parse_optional( const std::string &field, double max, double &value )
+{
+   char *end = NULL;
+   if ( field.empty() ) {
+      value = -1;
+      return 0;
+   }
+   double num = strtod( field.c_str(), &end );
+   if ( *end != '\0' || !( num >= 0 && num <= max ) ) {
+      return 1;
+   }
+   value = num;
+   return 0;
+}
+
+int gps_parse(gps_data &data, const std::vector<std::string> &nmeaLine)
+{
+      double latitude, longitude, speed, course;
+
+      // $xxRMC,time,status,lat,N/S,lon,E/W,speed,course,date,...
+      if ( nmeaLine.size() < 12 || nmeaLine[0].size() != 6 \
+	   || nmeaLine[0].compare( 3, 3, "RMC" ) != 0 \
+	   || nmeaLine[2] != "A" ) {
+	  return 1;
+      }
+
+      if ( parse_coordinate( nmeaLine[3], 9000.0, latitude ) != 0 \
+	   || parse_coordinate( nmeaLine[5], 18000.0, longitude ) != 0 \
+	   || parse_optional( nmeaLine[7], 1000.0, speed ) != 0 \
+	   || parse_optional( nmeaLine[8], 360.0, course ) != 0 \
+	   || ( nmeaLine[4] != "N" && nmeaLine[4] != "S" ) \
+	   || ( nmeaLine[6] != "E" && nmeaLine[6] != "W" ) \
+	   || nmeaLine[1].empty() ) {
+	  if ( log_enabled( LOG_INFO ) ) {
+	      std::cout << "Malformed RMC fields" << std::endl;
+	  }
+	  return 1;
+      }
+
+      data.timeStamp = nmeaLine[1];
+      data.latitude = latitude / 100.00;
+      data.northsouth = nmeaLine[4];
+      data.longitude = longitude / 100.00;
+      data.eastwest = nmeaLine[6];
+      data.speed = speed;
+      data.course = course;
+      if ( log_enabled( LOG_DEBUG ) ) {
+	  std::cout << "Timestamp: " << data.timeStamp << " Latitude: " 
+		    << data.latitude << data.northsouth 
+		    << " Longitude: " << data.longitude << data.eastwest << std::endl;
+      }
+
+      return 0;
 }
 
 void gps_close(int USB)
@@ -17,11 +17,22 @@
 #include <unistd.h>
 #include <errno.h>
 #include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 /* Header guard */
 #ifndef GPS_H
 #define GPS_H
 
+/* Size of the GPS read buffer, enough for a full 10 Hz NMEA burst */
+#define GPS_BUF_SIZE 1024
+
+/* How long the GPS thread waits for a sentence before checking for
+ * rate changes and shutdown (ms) */
+#define GPS_READ_TIMEOUT 1000
+
 /* Variable Declarations */
 struct gps_data
 {
@@ -30,6 +41,27 @@ struct gps_data
     double longitude;
     std::string northsouth;
     std::string eastwest;
+    double speed;  /* knots over ground, -1 if not reported */
+    double course; /* degrees true, -1 if not reported */
+};
+
+/* Buffered, non-blocking GPS port */
+struct gps_port
+{
+    int fd;
+    char buf[GPS_BUF_SIZE];
+    int start; /* first unconsumed byte */
+    int end;   /* one past the last byte read */
+    bool discarding; /* dropping the rest of an over-long line */
+
+    /* Arrival time of the first byte of the partial sentence at start */
+    struct timespec pending;
+
+    /* Time of the most recent read */
+    struct timespec last_read;
+
+    /* Arrival time of the first byte of the last sentence returned */
+    struct timespec arrival;
 };
 
 /* Function Declarations */
@@ -38,44 +70,100 @@ std::vector<std::string> split( const std::string &s, char delim);
 
 /**
  * gps_init()
- * Initializes the USB port for the GPS device
+ * Initializes the USB port for the GPS device. The port is opened
+ * non-blocking in raw mode with low-latency serial mode requested.
  * Params: 
  *   usb_path - the path of the USB port the GPS is connected to.
+ *   baud - the baud rate of the port
  * Returns: 
  *   USB - the initialized USB port
+ *   -1 - if the port could not be opened or configured
  */
-int gps_init(std::string usb_path);
+int gps_init(std::string usb_path, int baud);
 
 /**
- * gps_write()
- * Writes configuration logic to the GPS device
+ * gps_port_init()
+ * Attaches a read buffer to an initialized GPS port
  * Params: 
+ *   port - the buffered port
  *   USB - the initialized USB port
  * Returns: 
  *   None
  */
-void gps_write(int USB);
+void gps_port_init(gps_port &port, int USB);
 
 /**
- * gps_read()
- * Reads the GPS data from the GPS device
+ * gps_read_line()
+ * Waits for a complete NMEA sentence. Reads take whatever the tty has
+ * buffered, so a whole burst of sentences costs one system call.
+ * Params: 
+ *   port - the buffered port
+ *   line - the sentence, without the trailing CR/LF
+ *   timeout_ms - how long the whole call may wait, -1 to block
+ * Returns: 
+ *   0 - if a sentence was read; port.arrival holds the time its first
+ *       byte arrived. A line longer than the buffer is dropped up to
+ *       and including its newline.
+ *   1 - if the timeout expired
+ *   -1 - if the read failed or the port was closed or hung up
+ */
+int gps_read_line(gps_port &port, std::string &line, int timeout_ms);
+
+/**
+ * gps_baud_speed()
+ * Converts a baud rate to its termios speed
+ * Params: 
+ *   baud - the baud rate, e.g. 115200
+ * Returns: 
+ *   the speed_t constant, or 0 if the rate is not supported
+ */
+speed_t gps_baud_speed(int baud);
+
+/**
+ * gps_set_baud()
+ * Changes the baud rate of the local port
  * Params: 
  *   USB - the initialized USB port
+ *   baud - the new baud rate
+ * Returns: 
+ *   0 - if the rate was applied
+ *   1 - otherwise
+ */
+int gps_set_baud(int USB, int baud);
+
+/**
+ * nmea_checksum()
+ * Params: 
+ *   body - the sentence between '$' and '*'
  * Returns: 
- *   nmeaLine - the NMEA string output by the GPS
+ *   the XOR of every character in body
  */
-std::vector<std::string> gps_read(int USB);
+uint8_t nmea_checksum(const std::string &body);
+
+/**
+ * nmea_verify()
+ * Checks the framing and checksum of a sentence
+ * Params: 
+ *   line - the sentence, "$<body>*<two hex digits>"
+ * Returns: 
+ *   0 - if the sentence is intact
+ *   1 - otherwise
+ */
+int nmea_verify(const std::string &line);
 
 /**
  * gps_parse()
- * Parses the NMEA string into invididual GPS data fields
+ * Parses a valid GPRMC/GNRMC sentence into invididual GPS data fields.
+ * Any other sentence, a void fix or a malformed field is rejected
+ * without touching data.
  * Params: 
  *   data - the data structure containing GPS fields
- *   nmeaLine - the NMEA string output by the GPS
+ *   nmeaLine - the NMEA string output by the GPS, split on commas
  * Returns: 
- *   data - the data structure containing GPS fields
+ *   0 - if data was updated
+ *   1 - if the sentence was rejected
  */
-struct gps_data gps_parse(gps_data data, std::vector<std::string> nmeaLine);
+int gps_parse(gps_data &data, const std::vector<std::string> &nmeaLine);
 
 /**
  * gps_close()
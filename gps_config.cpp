@@ -0,0 +1,378 @@
+/*
+ * gps_config.cpp
+ * UBCST Electrical Division
+ * Runtime configuration of the GPS receiver over the PMTK protocol.
+ */
+
+#include <fstream>
+#include <iomanip>
+
+#include "gps_config.h"
+#include "config.h"
+
+/* Upper bound on the length of one NMEA sentence, used for link budgets */
+#define NMEA_MAX_LENGTH 82
+
+/* Sentence names accepted in the configuration file */
+static const struct
+{
+    const char *name;
+    int field;
+} SENTENCE_KEYS[] =
+{
+    { "gll", NMEA_GLL },
+    { "rmc", NMEA_RMC },
+    { "vtg", NMEA_VTG },
+    { "gga", NMEA_GGA },
+    { "gsa", NMEA_GSA },
+    { "gsv", NMEA_GSV },
+    { "zda", NMEA_ZDA }
+};
+
+gps_config gps_config_default(void)
+{
+   gps_config config;
+   memset( &config, 0, sizeof config );
+
+   config.rate_hz = 5;
+   config.baud = 115200;
+   config.easy = false;
+   config.output[NMEA_RMC] = 1;
+
+   return config;
+}
+
+int gps_config_load(const std::string &path, gps_config &config)
+{
+   std::ifstream file( path.c_str() );
+   if ( !file ) {
+      std::cout << "Cannot open GPS config " << path << std::endl;
+      return 1;
+   }
+
+   std::string line, key, value;
+   int lineNum = 0;
+   int status = 0;
+
+   while ( getline( file, line ) ) {
+      lineNum++;
+      int result = config_split_line( line, key, value );
+      if ( result > 0 ) {
+	 continue;
+      }
+      if ( result < 0 ) {
+	 std::cout << path << ":" << lineNum << ": expected key = value" \
+		   << std::endl;
+	 status = 1;
+	 continue;
+      }
+
+      char *end = NULL;
+      long num = strtol( value.c_str(), &end, 10 );
+      if ( value.empty() || *end != '\0' ) {
+	 std::cout << path << ":" << lineNum << ": bad value " << value \
+		   << std::endl;
+	 status = 1;
+	 continue;
+      }
+
+      bool known = true;
+      if ( key == "rate_hz" ) {
+	 config.rate_hz = num;
+      } else if ( key == "baud" ) {
+	 config.baud = num;
+      } else if ( key == "easy" ) {
+	 config.easy = ( num != 0 );
+      } else {
+	 known = false;
+	 for ( size_t i = 0; i < sizeof SENTENCE_KEYS / sizeof SENTENCE_KEYS[0]; i++ ) {
+	    if ( key == SENTENCE_KEYS[i].name ) {
+	       config.output[SENTENCE_KEYS[i].field] = num;
+	       known = true;
+	    }
+	 }
+      }
+
+      if ( !known ) {
+	 std::cout << path << ":" << lineNum << ": unknown key " << key \
+		   << std::endl;
+	 status = 1;
+      }
+   }
+
+   /* Range checks */
+   if ( config.rate_hz < 1 || config.rate_hz > 10 ) {
+      std::cout << "rate_hz must be 1 to 10" << std::endl;
+      status = 1;
+   }
+   if ( gps_baud_speed( config.baud ) == 0 ) {
+      std::cout << "Unsupported baud rate " << config.baud << std::endl;
+      status = 1;
+   }
+   for ( int i = 0; i < PMTK_OUTPUT_FIELDS; i++ ) {
+      if ( config.output[i] < 0 || config.output[i] > 5 ) {
+	 std::cout << "Sentence output rate must be 0 to 5" << std::endl;
+	 status = 1;
+	 break;
+      }
+   }
+
+   return status;
+}
+
+std::string pmtk_build(int cmd, const std::string &args)
+{
+   std::ostringstream body;
+   body << "PMTK" << std::setfill( '0' ) << std::setw( 3 ) << cmd;
+   if ( !args.empty() ) {
+      body << "," << args;
+   }
+
+   char checksum[3];
+   snprintf( checksum, sizeof checksum, "%02X", nmea_checksum( body.str() ) );
+
+   return "$" + body.str() + "*" + checksum + "\r\n";
+}
+
+/**
+ * pmtk_ack_flag()
+ * Checks whether a sentence is a valid $PMTK001 reply to cmd
+ * Returns:
+ *   the reply flag, or -1 if the sentence is not a reply to cmd
+ */
+static int pmtk_ack_flag( const std::string &line, int cmd )
+{
+   if ( nmea_verify( line ) != 0 ) {
+      return -1;
+   }
+
+   std::string body = line.substr( 1, line.rfind( '*' ) - 1 );
+   std::vector<std::string> fields = split( body, ',' );
+   if ( fields.size() != 3 || fields[0] != "PMTK001" \
+	|| atoi( fields[1].c_str() ) != cmd ) {
+      return -1;
+   }
+
+   return atoi( fields[2].c_str() );
+}
+
+static long ms_until( const struct timespec &deadline )
+{
+   struct timespec now;
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return ( deadline.tv_sec - now.tv_sec ) * 1000L \
+      + ( deadline.tv_nsec - now.tv_nsec ) / 1000000L;
+}
+
+/**
+ * pmtk_write()
+ * Writes a complete PMTK sentence to the port
+ * Returns:
+ *   0 - if every byte was written
+ *   1 - otherwise
+ */
+static int pmtk_write( gps_port &port, const std::string &str )
+{
+   std::cout << "PMTK String: " << str;
+   if ( write( port.fd, str.c_str(), str.size() ) != (ssize_t)str.size() ) {
+      std::cout << "Error " << errno << " writing PMTK command: " \
+		<< strerror( errno ) << std::endl;
+      return 1;
+   }
+   return 0;
+}
+
+int pmtk_send(gps_port &port, int cmd, const std::string &args,
+	      int timeout_ms)
+{
+   if ( pmtk_write( port, pmtk_build( cmd, args ) ) != 0 ) {
+      return -1;
+   }
+
+   struct timespec deadline;
+   clock_gettime( CLOCK_MONOTONIC, &deadline );
+   deadline.tv_sec += timeout_ms / 1000;
+   deadline.tv_nsec += ( timeout_ms % 1000 ) * 1000000L;
+   if ( deadline.tv_nsec >= 1000000000L ) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+   }
+
+   std::string line;
+   long remaining;
+   while ( ( remaining = ms_until( deadline ) ) > 0 ) {
+      int result = gps_read_line( port, line, remaining );
+      if ( result < 0 ) {
+	 return -1;
+      }
+      if ( result > 0 ) {
+	 continue;
+      }
+
+      int flag = pmtk_ack_flag( line, cmd );
+      if ( flag >= 0 ) {
+	 return flag;
+      }
+   }
+
+   std::cout << "No acknowledgement for PMTK" << cmd << std::endl;
+   return -1;
+}
+
+/**
+ * output_bytes_per_sec()
+ * Estimates the worst-case NMEA output for a configuration
+ */
+static long output_bytes_per_sec( const gps_config &config )
+{
+   long bytes = 0;
+   for ( int i = 0; i < PMTK_OUTPUT_FIELDS; i++ ) {
+      if ( config.output[i] > 0 ) {
+	 /* GSV is split over up to three sentences */
+	 int sentences = ( i == NMEA_GSV ) ? 3 : 1;
+	 bytes += sentences * NMEA_MAX_LENGTH * config.rate_hz / config.output[i];
+      }
+   }
+   return bytes;
+}
+
+int gps_max_rate(const gps_config &config)
+{
+   gps_config trial = config;
+
+   /* 8N1 framing: ten bits on the wire per byte */
+   for ( trial.rate_hz = 10; trial.rate_hz > 1; trial.rate_hz-- ) {
+      if ( output_bytes_per_sec( trial ) <= trial.baud / 10 ) {
+	 break;
+      }
+   }
+   return trial.rate_hz;
+}
+
+/**
+ * port_baud()
+ * Returns the baud rate the local port is set to, or 0 if unknown
+ */
+static int port_baud( int fd )
+{
+   static const int BAUDS[] = { 9600, 19200, 38400, 57600, 115200 };
+   struct termios tty;
+
+   if ( tcgetattr( fd, &tty ) != 0 ) {
+      return 0;
+   }
+   for ( size_t i = 0; i < sizeof( BAUDS ) / sizeof( BAUDS[0] ); i++ ) {
+      if ( cfgetospeed( &tty ) == gps_baud_speed( BAUDS[i] ) ) {
+	 return BAUDS[i];
+      }
+   }
+   return 0;
+}
+
+/**
+ * switch_baud()
+ * Changes the local baud rate and drops what was buffered at the old one
+ */
+static int switch_baud( gps_port &port, int baud )
+{
+   if ( gps_set_baud( port.fd, baud ) != 0 ) {
+      return 1;
+   }
+   port.start = 0;
+   port.end = 0;
+   port.discarding = false;
+   return 0;
+}
+
+int gps_configure(gps_port &port, const gps_config &config)
+{
+   int status = 0;
+   int flag;
+
+   if ( config.rate_hz < 1 || config.rate_hz > 10 ) {
+      std::cout << "Unsupported fix rate " << config.rate_hz << " Hz" \
+		<< std::endl;
+      return 1;
+   }
+
+   /* 8N1 framing: ten bits on the wire per byte */
+   if ( output_bytes_per_sec( config ) > config.baud / 10 ) {
+      std::cout << "Sentence output at " << config.rate_hz \
+		<< " Hz does not fit in " << config.baud << " baud" \
+		<< std::endl;
+      return 1;
+   }
+
+   /* The receiver switches baud rate without acknowledging, so follow it
+    * locally and confirm with a test packet. If it does not answer at
+    * the port's rate it may already be at the target, e.g. when the Pi
+    * restarted but the receiver kept power. */
+   std::ostringstream args;
+   int baud = port_baud( port.fd );
+   if ( baud != config.baud ) {
+      if ( pmtk_send( port, PMTK_TEST, "", PMTK_ACK_TIMEOUT ) == PMTK_ACK_SUCCESS ) {
+	 args << config.baud;
+	 if ( pmtk_write( port, pmtk_build( PMTK_SET_BAUD, args.str() ) ) != 0 ) {
+	    return 1;
+	 }
+	 tcdrain( port.fd );
+	 usleep( 100000 );
+      }
+      else {
+	 std::cout << "No reply from GPS at " << baud << " baud, trying " \
+		   << config.baud << std::endl;
+      }
+      if ( switch_baud( port, config.baud ) != 0 ) {
+	 return 1;
+      }
+   }
+   if ( pmtk_send( port, PMTK_TEST, "", PMTK_ACK_TIMEOUT ) != PMTK_ACK_SUCCESS ) {
+      std::cout << "GPS not responding at " << config.baud << " baud" \
+		<< std::endl;
+      return 1;
+   }
+
+   /* Sentence output mask */
+   args.str( "" );
+   for ( int i = 0; i < PMTK_OUTPUT_FIELDS; i++ ) {
+      args << ( i ? "," : "" ) << config.output[i];
+   }
+   flag = pmtk_send( port, PMTK_SET_OUTPUT, args.str(), PMTK_ACK_TIMEOUT );
+   if ( flag != PMTK_ACK_SUCCESS ) {
+      std::cout << "Set output mask failed: " << flag << std::endl;
+      status = 1;
+   }
+
+   if ( gps_set_rate( port, config.rate_hz, config.easy ) != 0 ) {
+      status = 1;
+   }
+
+   return status;
+}
+
+int gps_set_rate(gps_port &port, int rate_hz, bool easy)
+{
+   std::ostringstream args;
+   int status = 0;
+   int flag;
+
+   /* EASY only works at 1 Hz */
+   args << "1," << ( easy && rate_hz == 1 ? 1 : 0 );
+   flag = pmtk_send( port, PMTK_SET_EASY, args.str(), PMTK_ACK_TIMEOUT );
+   if ( flag != PMTK_ACK_SUCCESS ) {
+      std::cout << "Set EASY failed: " << flag << std::endl;
+      status = 1;
+   }
+
+   /* Fix interval in milliseconds */
+   args.str( "" );
+   args << 1000 / rate_hz;
+   flag = pmtk_send( port, PMTK_SET_FIX_INTERVAL, args.str(), PMTK_ACK_TIMEOUT );
+   if ( flag != PMTK_ACK_SUCCESS ) {
+      std::cout << "Set update rate to " << rate_hz << "Hz failed: " \
+		<< flag << std::endl;
+      status = 1;
+   }
+
+   return status;
+}
@@ -0,0 +1,152 @@
+/*
+ * gps_config.h
+ * UBCST Electrical Division
+ * Runtime configuration of the GPS receiver over the PMTK protocol.
+ *
+ * Commands are built with their checksum computed here and every
+ * command that the receiver acknowledges is checked against its
+ * $PMTK001 reply. Protocol documentation:
+ *   https://www.adafruit.com/datasheets/PMTK_A08.pdf
+ *   http://www.adafruit.com/datasheets/PMTK_A11.pdf
+ */
+
+#include <string>
+
+#include "gps.h"
+
+/* Header guard */
+#ifndef GPS_CONFIG_H
+#define GPS_CONFIG_H
+
+/* PMTK command numbers */
+#define PMTK_TEST 0
+#define PMTK_SET_BAUD 251
+#define PMTK_SET_FIX_INTERVAL 220
+#define PMTK_SET_OUTPUT 314
+#define PMTK_SET_EASY 869
+
+/* $PMTK001 flag values */
+#define PMTK_ACK_INVALID 0
+#define PMTK_ACK_UNSUPPORTED 1
+#define PMTK_ACK_FAILED 2
+#define PMTK_ACK_SUCCESS 3
+
+/* How long to wait for a $PMTK001 reply (ms) */
+#define PMTK_ACK_TIMEOUT 1000
+
+/* Number of fields in a PMTK314 output mask */
+#define PMTK_OUTPUT_FIELDS 19
+
+/* PMTK314 field positions */
+enum nmea_sentence
+{
+    NMEA_GLL = 0,
+    NMEA_RMC = 1,
+    NMEA_VTG = 2,
+    NMEA_GGA = 3,
+    NMEA_GSA = 4,
+    NMEA_GSV = 5,
+    NMEA_ZDA = 17
+};
+
+/* Receiver settings */
+struct gps_config
+{
+    int rate_hz; /* fix rate, 1 to 10 */
+    int baud;    /* 9600, 19200, 38400, 57600 or 115200 */
+    bool easy;   /* EASY assisted fixes, only valid at 1 Hz */
+
+    /* Output every Nth fix for each sentence (0 disables, max 5) */
+    int output[PMTK_OUTPUT_FIELDS];
+};
+
+/**
+ * gps_config_default()
+ * Returns the built-in settings: RMC only, EASY off, 5 Hz, 115200 baud.
+ */
+gps_config gps_config_default(void);
+
+/**
+ * gps_config_load()
+ * Reads receiver settings from a file of "key = value" lines. Keys are
+ * rate_hz, baud, easy and the sentence names gll, rmc, vtg, gga, gsa,
+ * gsv and zda. Lines starting with '#' are ignored. Keys missing from
+ * the file keep the value already in config.
+ * Params:
+ *   path - the configuration file
+ *   config - the settings to update
+ * Returns:
+ *   0 - if the file was read and every value is in range
+ *   1 - otherwise
+ */
+int gps_config_load(const std::string &path, gps_config &config);
+
+/**
+ * pmtk_build()
+ * Frames a PMTK command with its checksum and line ending
+ * Params:
+ *   cmd - the PMTK command number
+ *   args - the comma-separated arguments, may be empty
+ * Returns:
+ *   the complete sentence, e.g. "$PMTK220,200*2C\r\n"
+ */
+std::string pmtk_build(int cmd, const std::string &args);
+
+/**
+ * pmtk_send()
+ * Writes a PMTK command and waits for its $PMTK001 acknowledgement.
+ * Sentences read while waiting are discarded.
+ * Params:
+ *   port - the buffered GPS port
+ *   cmd - the PMTK command number
+ *   args - the comma-separated arguments
+ *   timeout_ms - how long to wait for the acknowledgement
+ * Returns:
+ *   PMTK_ACK_SUCCESS - if the receiver accepted the command
+ *   the $PMTK001 flag - if the receiver rejected it
+ *   -1 - if the write or a read failed, or no acknowledgement arrived
+ *        in time
+ */
+int pmtk_send(gps_port &port, int cmd, const std::string &args,
+	      int timeout_ms);
+
+/**
+ * gps_max_rate()
+ * Finds the highest fix rate whose sentence output fits the baud rate
+ * Params:
+ *   config - the settings; rate_hz is ignored
+ * Returns:
+ *   the rate in Hz, 1 to 10 (1 even if 1 Hz does not fit)
+ */
+int gps_max_rate(const gps_config &config);
+
+/**
+ * gps_set_rate()
+ * Sets the fix rate, turning EASY mode on only at 1 Hz
+ * Params:
+ *   port - the buffered GPS port
+ *   rate_hz - the fix rate, 1 to 10
+ *   easy - whether EASY mode is wanted when the rate allows it
+ * Returns:
+ *   0 - if both commands were acknowledged
+ *   1 - otherwise
+ */
+int gps_set_rate(gps_port &port, int rate_hz, bool easy);
+
+/**
+ * gps_configure()
+ * Applies receiver settings: baud rate first (also switching the local
+ * port), then the output mask, EASY mode and fix rate. A receiver that
+ * does not answer at the port's baud rate is looked for at the target
+ * rate, where a previous run may have left it.
+ * Params:
+ *   port - the buffered GPS port
+ *   config - the settings to apply
+ * Returns:
+ *   0 - if every setting was acknowledged
+ *   1 - if any setting was rejected or not acknowledged, or the
+ *       receiver answers at neither baud rate
+ */
+int gps_configure(gps_port &port, const gps_config &config);
+
+#endif /* End header guard */
@@ -4,74 +4,441 @@
  * UBCST Electrical Division
  */
 
+#include <atomic>
+#include <signal.h>
+#include <pthread.h>
+
 #include "gps.h"
+#include "gps_config.h"
 #include "comms.h"
+#include "reliable.h"
+#include "config.h"
+#include "command.h"
+#include "shm_bus.h"
+#include "runtime.h"
+#include "governor.h"
+#include "estimator.h"
+
+/* USB loop period at full headroom and at none, and how long each pass
+ * waits for an inbound frame (ms) */
+#define USB_LOOP_PERIOD 20
+#define USB_LOOP_PERIOD_MAX 50
+#define USB_RX_TIMEOUT 5
+
+/* Consecutive failed polls after which the phone is taken to be gone */
+#define USB_MAX_ERRORS 50
+
+/* Time given to unacknowledged alarms at shutdown (ms) */
+#define USB_DRAIN_TIMEOUT 1000
 
-/* Set the path of the GPS port */
-#define GPS_PATH "/dev/ttyACM0"
+/* Cleared by SIGINT or SIGTERM, or when the phone is lost */
+static std::atomic<bool> running(true);
 
-#define TEST_MODE 1
+/* State owned by the GPS thread */
+struct gps_task
+{
+    gps_port port;
+    gps_config config;
+    bus_publisher *bus;  /* where fixes are published */
+    int rate_hz;         /* fix rate the receiver is set to */
+    int attempted;       /* last rate tried, so a refused one is not retried */
+    unsigned long fixes; /* valid fixes parsed */
+};
+
+/* Time from the first byte of a sentence to its fix being sent */
+struct fix_latency
+{
+    unsigned long count;
+    double sum_ns;
+    int64_t max_ns;
+};
 
-int main(void)
+/* State owned by the estimator thread */
+struct est_task
 {
-    std::vector<std::string> nmeaLine;
+    bus_publisher *bus;    /* where fixes are read and estimates published */
+    rt_jitter jitter;      /* wake-up lateness of the output loop */
+    unsigned long outputs; /* estimates published */
+};
+
+static void stop_running(int)
+{
+    running.store(false);
+}
+
+/**
+ * apply_gps_rate()
+ * Sets the receiver to the governed fix rate. The ceiling is the rate
+ * requested with CMD_SET_GPS_RATE (gps.conf's until one arrives),
+ * limited to what the baud rate can carry.
+ */
+static void apply_gps_rate(gps_task &task)
+{
+    int requested = cmd_gps_rate();
+    if(requested == 0)
+	requested = task.config.rate_hz;
+
+    int ceiling = requested;
+    int max = gps_max_rate(task.config);
+    if(ceiling > max)
+	ceiling = max;
+
+    int rate = gov_gps_rate(ceiling);
+    if(rate == task.attempted)
+	return;
+    task.attempted = rate;
+
+    if(requested > max)
+	std::cout << "GPS rate " << requested << " Hz limited to " << max
+		  << " Hz by the baud rate" << std::endl;
+
+    /* gps_set_rate() reports what failed; the rate is not retried
+     * until the target changes */
+    if(gps_set_rate(task.port, rate, task.config.easy) != 0)
+	return;
+
+    task.rate_hz = rate;
+}
+
+/**
+ * gps_loop()
+ * The GPS thread: configures the receiver, then reads and parses
+ * sentences and applies fix rate changes until shutdown
+ */
+static void *gps_loop(void *arg)
+{
+    gps_task &task = *(gps_task *)arg;
     gps_data data;
-    int gpsPort = 0;
+    std::string line;
+
+    rt_setup_thread(RT_ACQUISITION);
+
+    if(gps_configure(task.port, task.config) != 0)
+	std::cout << "GPS not fully configured" << std::endl;
+    task.rate_hz = task.config.rate_hz;
+    task.attempted = task.rate_hz;
 
-    libusb_device **device; 
+    while(running.load())
+    {
+	apply_gps_rate(task);
+
+	int result = gps_read_line(task.port, line, GPS_READ_TIMEOUT);
+	if(result < 0)
+	{
+	    std::cout << "GPS lost, no more fixes" << std::endl;
+	    break;
+	}
+
+	if(result > 0 || nmea_verify(line) != 0)
+	    continue;
+
+	if(gps_parse(data, split(line, ',')) == 0)
+	{
+	    bus_publish_gps(*task.bus, data, task.port.arrival);
+	    task.fixes++;
+	}
+    }
+
+    return NULL;
+}
+
+/**
+ * fix_from_bus()
+ * Rebuilds the gps_data a bus record was published from
+ */
+static void fix_from_bus(const bus_gps &in, gps_data &fix)
+{
+    fix.timeStamp = in.timeStamp;
+    fix.latitude = in.latitude;
+    fix.longitude = in.longitude;
+    fix.northsouth = std::string(1, in.northsouth);
+    fix.eastwest = std::string(1, in.eastwest);
+    fix.speed = in.speed;
+    fix.course = in.course;
+}
+
+/**
+ * est_loop()
+ * The estimator thread: once per output period, advances the filter,
+ * folds in the fixes and sensor readings published since, and publishes
+ * the estimate. The period follows gov_sample_rate(STREAM_ESTIMATOR).
+ */
+static void *est_loop(void *arg)
+{
+    est_task &task = *(est_task *)arg;
+    bus_reader input;
+    bus_record record;
+    estimator est;
+    est_position position;
+    sensor_data sensor;
+    gps_data fix;
+    struct timespec last, now;
+
+    rt_setup_thread(RT_ACQUISITION);
+
+    if(bus_open(input) != 0)
+    {
+	std::cout << "Estimator cannot read the bus" << std::endl;
+	return NULL;
+    }
+
+    int rate = gov_sample_rate(STREAM_ESTIMATOR);
+    est_config config = { (double)rate, EST_ACCEL_NOISE, EST_GPS_NOISE,
+			  EST_SPEED_NOISE };
+    est_init(est, config);
+
+    /* Until sensor.cpp reads hardware nothing publishes BUS_SENSOR and
+     * the filter coasts on its velocity between fixes */
+    memset(&sensor, 0, sizeof(sensor));
+
+    rt_jitter_init(task.jitter, (int64_t)est_period_us(est) * 1000);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while(running.load())
+    {
+	rt_jitter_wait(task.jitter);
+
+	/* A new rate takes effect from the next deadline */
+	int newRate = gov_sample_rate(STREAM_ESTIMATOR);
+	if(newRate != rate)
+	{
+	    rate = newRate;
+	    est.config.rate_hz = rate;
+	    task.jitter.period_ns = (int64_t)est_period_us(est) * 1000;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+	last = now;
+
+	est_predict(est, sensor, dt);
+
+	while(bus_read_next(input, record) == 0)
+	{
+	    if(record.type == BUS_GPS)
+	    {
+		fix_from_bus(record.gps, fix);
+		est_update_gps(est, fix);
+	    }
+	    else if(record.type == BUS_SENSOR)
+	    {
+		sensor = record.sensor;
+		est_update_speed(est, sensor.speed);
+	    }
+	}
+
+	if(est_output(est, position) == 0)
+	{
+	    bus_publish_position(*task.bus, position);
+	    task.outputs++;
+	}
+    }
+
+    bus_close(input);
+    return NULL;
+}
+
+/**
+ * send_fix()
+ * Sends a fix to the phone as "$GPS,<lat>,<N/S>,<lon>,<E/W>,<hh:mm:ss>,$END"
+ * and records its latency if the write succeeded
+ */
+static void send_fix(rely_session &session, const bus_gps &fix,
+		     fix_latency &latency)
+{
+    char message[USB_MSG_SIZE];
+    int length = snprintf(message, sizeof(message),
+			  "$GPS,%.6f,%c,%.6f,%c,%.2s:%.2s:%.2s,$END",
+			  fix.latitude, fix.northsouth, fix.longitude,
+			  fix.eastwest, fix.timeStamp, fix.timeStamp + 2,
+			  fix.timeStamp + 4);
+
+    if(rely_send(session, CLASS_TELEMETRY, (unsigned char *)message, length) != 0)
+	return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t late = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec
+	- (int64_t)fix.arrival_ns;
+
+    latency.count++;
+    latency.sum_ns += late;
+    if(late > latency.max_ns)
+	latency.max_ns = late;
+}
+
+int main(int argc, char **argv)
+{
     libusb_device_handle *phone = NULL; /* a handle for the phone connection */
-    int returnVal = 0; /* returned values of functions */
+    rely_session session; /* sequencing and retransmit state for the phone */
+    bus_publisher bus; /* shared-memory feed for other processes */
+    bus_reader fixes; /* the same feed, read back for the phone */
+    gps_task gps; /* GPS receiver, owned by the GPS thread */
+    est_task est; /* position estimate, owned by the estimator thread */
+    pthread_t gpsThread, estThread;
+    bool haveGps = false, haveEst = false;
+
+    /* Load settings before anything reads them */
+    if(config_load(argc, argv) != 0)
+	return 1;
+
+    const telemetry_config &config = config_get();
+    cmd_init();
+
+    /* Shut down cleanly on Ctrl-C or kill */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_running;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
 
-    unsigned char message[USB_MSG_SIZE] = "$GPS,123.01,N,456.02,W,10:09:08,$END";
+    /* Lock memory before the big buffers are touched; this thread
+     * drives the USB link */
+    rt_setup_process();
+    rt_setup_thread(RT_USB);
+
+    /* Other processes on the car read GPS data from here, and so do
+     * the USB loop and the estimator; without it nothing reaches the
+     * phone */
+    if(bus_create(bus) != 0)
+	return 1;
+    if(bus_open(fixes) != 0)
+    {
+	std::cout << "Cannot read the telemetry bus" << std::endl;
+	bus_destroy(bus);
+	return 1;
+    }
 
-    int counter = 0;
+    /* Scale sampling with CPU, thermal and link headroom */
+    governor_start();
 
     /* Initialize phone and GPS sessions */
-    usb_init(device, phone);
-    if(phone == NULL) {
-       std::cout << "Phone is null" << std::endl;
-    } else {
-       std::cout << "Phone: " << phone << std::endl;
+    if(usb_init(phone) != 0)
+    {
+	std::cout << "Phone not connected" << std::endl;
+	governor_stop();
+	bus_close(fixes);
+	bus_destroy(bus);
+	return 1;
+    }
+
+    int gpsPort = gps_init(config.gps_path, config.gps_baud);
+    if(gpsPort >= 0)
+    {
+	gps_port_init(gps.port, gpsPort);
+	gps.config = gps_config_default();
+	if(gps_config_load(config.gps_config_path, gps.config) != 0)
+	{
+	    std::cout << "Using default GPS settings" << std::endl;
+	    gps.config = gps_config_default();
+	}
+	gps.bus = &bus;
+	gps.fixes = 0;
+
+	haveGps = (rt_thread_create(gpsThread, gps_loop, &gps) == 0);
     }
+    if(!haveGps)
+	std::cout << "Running without GPS" << std::endl;
 
-    if(TEST_MODE)
+    /* Dead reckoning between fixes; without GPS it has no origin */
+    if(haveGps)
+    {
+	est.bus = &bus;
+	est.outputs = 0;
+	memset(&est.jitter, 0, sizeof(est.jitter));
+	haveEst = (rt_thread_create(estThread, est_loop, &est) == 0);
+    }
+
+    if(log_enabled(LOG_DEBUG))
 	std::cout << "Sending data..." << std::endl;
-    
-    send_data(phone, message, USB_MSG_SIZE);
 
-    if(TEST_MODE)
-	std::cout << "Close session..." << std::endl;
-    
-    usb_close(phone);
-    
-    /*
-    gpsPort = gps_init(GPS_PATH);
+    rely_init(session, phone);
+    rt_prefault(&session, sizeof(session));
+    session.on_frame = cmd_handle_frame;
 
-    /* Write configuration settings to GPS device */
-    /*
-    gps_write(gpsPort);
+    /* USB loop: ACKs, commands and retransmissions, off the
+     * acquisition thread */
+    rt_jitter usbJitter;
+    rt_jitter_init(usbJitter, (int64_t)USB_LOOP_PERIOD * 1000000);
+    int errors = 0;
+    fix_latency latency;
+    memset(&latency, 0, sizeof(latency));
 
-    for(counter = 0; counter < 5; counter++)
+    while(running.load())
     {
-	nmeaLine = gps_read(gpsPort);
-
-	// std::cout << "The NMEA Line is: " << nmeaLine << std::endl;
-	std::cout << "The size of the NMEA Line is: " << nmeaLine.size() << std::endl;
+	rt_jitter_wait(usbJitter);
 
-	if(nmeaLine.size() >= 12)
+	if(rely_poll(session, USB_RX_TIMEOUT) == 0)
+	    errors = 0;
+	else if(++errors >= USB_MAX_ERRORS)
 	{
-	    data = gps_parse(data, nmeaLine);
+	    std::cout << "Phone connection lost" << std::endl;
+	    break;
 	}
+
+	/* Forward new fixes to the phone */
+	bus_record record;
+	while(bus_read_next(fixes, record) == 0)
+	    if(record.type == BUS_GPS)
+		send_fix(session, record.gps, latency);
+
+	const tx_channel &alarms = session.channels[CLASS_ALARM];
+	const tx_channel &telemetry = session.channels[CLASS_TELEMETRY];
+	int pending = rely_pending(session, CLASS_ALARM);
+	gov_report_link(pending, alarms.config.window, alarms.retransmits,
+			telemetry.sent, telemetry.dropped);
+
+	/* Poll less often as headroom falls, but never while alarms
+	 * wait for an ACK: slowing down would only grow the queue */
+	int period = USB_LOOP_PERIOD;
+	if(pending == 0)
+	    period += (USB_LOOP_PERIOD_MAX - USB_LOOP_PERIOD)
+		* (1000 - gov_headroom()) / 1000;
+	usbJitter.period_ns = (int64_t)period * 1000000;
+    }
+    running.store(false);
+
+    /* Give guaranteed frames a last chance to be acknowledged */
+    for(int waited = 0; errors == 0 && waited < USB_DRAIN_TIMEOUT
+	    && rely_pending(session, CLASS_ALARM) > 0; waited += USB_LOOP_PERIOD)
+	rely_poll(session, USB_LOOP_PERIOD);
+
+    if(log_enabled(LOG_DEBUG))
+	std::cout << "Close session..." << std::endl;
+
+    if(haveGps)
+    {
+	pthread_join(gpsThread, NULL);
+	std::cout << "GPS: " << gps.fixes << " fixes" << std::endl;
+    }
+    if(haveEst)
+    {
+	pthread_join(estThread, NULL);
+	std::cout << "Estimator: " << est.outputs << " estimates" << std::endl;
+	rt_jitter_report(est.jitter, "estimator");
     }
-    std::cout << "Final Timestamp: " << data.timeStamp << " Latitude: " 
-	      << data.latitude << data.northsouth 
-	      << " Longitude: " << data.longitude << data.eastwest << std::endl;
-    */
 
-    /* Close the phone and GPS sessions */
+    rt_jitter_report(usbJitter, "usb");
+    for(int c = 0; c < NUM_MSG_CLASSES; c++)
+    {
+	const tx_channel &channel = session.channels[c];
+	std::cout << (c == CLASS_ALARM ? "Alarm" : "Telemetry") << " frames: "
+		  << channel.sent << " sent, " << channel.retransmits
+		  << " retransmitted, " << channel.dropped << " dropped" << std::endl;
+    }
+    std::cout << "Bus: " << fixes.missed << " records missed by the USB loop"
+	      << std::endl;
+    if(latency.count > 0)
+	std::cout << "Fix latency: " << latency.count << " fixes, mean "
+		  << (int64_t)(latency.sum_ns / latency.count) / 1000 << " us, max "
+		  << latency.max_ns / 1000 << " us" << std::endl;
+    if(gpsPort >= 0)
+	gps_close(gpsPort);
+
+    usb_close(phone);
 
-    /*
-    gps_close(gpsPort);
-    */
+    governor_stop();
+    bus_close(fixes);
+    bus_destroy(bus);
     return 0;
 }
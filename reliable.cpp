@@ -0,0 +1,325 @@
+/**
+ * reliable.cpp
+ * UBCST Electrical Division
+ * Reliable delivery layer on top of the accessory bulk pipes.
+ * See reliable.h for the frame layout.
+ */
+
+#include "reliable.h"
+
+/**
+ * seq_before()
+ * Compares sequence numbers modulo 2^16.
+ * Returns:
+ *   true - if a comes before b
+ */
+static bool seq_before(uint16_t a, uint16_t b)
+{
+    return (int16_t)(a - b) < 0;
+}
+
+/**
+ * elapsed_ms()
+ * Returns the milliseconds between two monotonic timestamps.
+ */
+static long elapsed_ms(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) * 1000L
+	+ (to.tv_nsec - from.tv_nsec) / 1000000L;
+}
+
+static void put_u16(unsigned char *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static tx_slot &slot_for(tx_channel &channel, uint16_t seq)
+{
+    return channel.slots[seq % RELY_WINDOW_MAX];
+}
+
+/**
+ * write_frame()
+ * Writes a complete frame to the OUT endpoint.
+ * Returns:
+ *   0 - if every byte was written
+ *   1 - if the transfer failed or was short
+ */
+static int write_frame(libusb_device_handle *handle, unsigned char *frame,
+		       int length)
+{
+    int actual = 0;
+
+    /* No phone attached (e.g. the test harness): the frame is lost */
+    if(handle == NULL)
+	return 1;
+
+    int returnVal = libusb_bulk_transfer(handle, config_get().out_point, frame,
+					 length, &actual, RELY_TX_TIMEOUT);
+
+    if(returnVal != 0 || actual != length)
+    {
+	if(log_enabled(LOG_DEBUG))
+	    std::cout << "Frame not sent: " << libusb_error_name(returnVal)
+		      << ", " << actual << " of " << length << std::endl;
+	return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * advance_base()
+ * Slides the window past every frame that is acknowledged or dropped.
+ */
+static void advance_base(tx_channel &channel)
+{
+    while(channel.base != channel.next_seq)
+    {
+	tx_slot &slot = slot_for(channel, channel.base);
+
+	if(slot.in_use && slot.seq == channel.base && !slot.acked)
+	    break;
+
+	slot.in_use = false;
+	channel.base++;
+    }
+}
+
+void rely_init(rely_session &session, libusb_device_handle *handle)
+{
+    const telemetry_config &config = config_get();
+
+    memset(&session, 0, sizeof(session));
+    session.handle = handle;
+
+    /* Telemetry is best-effort */
+    class_config &telemetry = session.channels[CLASS_TELEMETRY].config;
+    telemetry.reliable = false;
+    telemetry.window = 1;
+
+    /* Alarms are guaranteed */
+    class_config &alarm = session.channels[CLASS_ALARM].config;
+    alarm.reliable = true;
+    alarm.window = config.alarm_window;
+    alarm.rto_ms = config.alarm_rto_ms;
+    alarm.max_retries = config.alarm_retries;
+}
+
+int rely_configure(rely_session &session, msg_class cls,
+		   const class_config &config)
+{
+    if(cls < 0 || cls >= NUM_MSG_CLASSES)
+	return 1;
+
+    if(config.window < 1 || config.window > RELY_WINDOW_MAX)
+	return 1;
+
+    if(config.reliable && (config.rto_ms <= 0 || config.max_retries < 0))
+	return 1;
+
+    session.channels[cls].config = config;
+    return 0;
+}
+
+int rely_send(rely_session &session, msg_class cls,
+	      const unsigned char *payload, int length)
+{
+    if(cls < 0 || cls >= NUM_MSG_CLASSES)
+	return 1;
+
+    tx_channel &channel = session.channels[cls];
+    bool reliable = channel.config.reliable;
+    int header = FRAME_HEADER_SIZE + (reliable ? FRAME_BASE_SIZE : 0);
+
+    if(length < 0 || header + length > config_get().usb_msg_size)
+    {
+	std::cout << "Payload too large: " << length << std::endl;
+	return 1;
+    }
+
+    /* Window full: the caller must poll for ACKs before sending more */
+    if(reliable
+       && (uint16_t)(channel.next_seq - channel.base) >= channel.config.window)
+	return 1;
+
+    uint16_t seq = channel.next_seq++;
+    unsigned char scratch[USB_MSG_SIZE];
+    unsigned char *frame = scratch;
+
+    if(reliable)
+    {
+	tx_slot &slot = slot_for(channel, seq);
+	slot.in_use = true;
+	slot.acked = false;
+	slot.seq = seq;
+	slot.retries = 0;
+	slot.length = header + length;
+	frame = slot.frame;
+    }
+
+    frame[0] = FRAME_SYNC;
+    frame[1] = FRAME_DATA;
+    frame[2] = cls;
+    frame[3] = reliable ? FRAME_FLAG_BASE : 0;
+    put_u16(&frame[4], seq);
+    put_u16(&frame[6], header - FRAME_HEADER_SIZE + length);
+    if(reliable)
+	put_u16(&frame[FRAME_HEADER_SIZE], channel.base);
+    memcpy(&frame[header], payload, length);
+
+    int returnVal = write_frame(session.handle, frame, header + length);
+    channel.sent++;
+
+    if(!reliable)
+    {
+	/* Best-effort frames leave the window as soon as they are written */
+	channel.base = channel.next_seq;
+	if(returnVal != 0)
+	    channel.dropped++;
+	return returnVal;
+    }
+
+    /* A failed write is left to the retransmit timer */
+    clock_gettime(CLOCK_MONOTONIC, &slot_for(channel, seq).sent);
+    return 0;
+}
+
+int rely_handle_ack(rely_session &session, const unsigned char *frame,
+		    int length)
+{
+    if(length < FRAME_HEADER_SIZE || frame[0] != FRAME_SYNC
+       || frame[1] != FRAME_ACK || frame[2] >= NUM_MSG_CLASSES)
+	return 1;
+
+    tx_channel &channel = session.channels[frame[2]];
+    uint16_t ack = get_u16(&frame[4]);
+    uint32_t sack = 0;
+
+    if(get_u16(&frame[6]) >= 4 && length >= FRAME_HEADER_SIZE + 4)
+    {
+	const unsigned char *p = &frame[FRAME_HEADER_SIZE];
+	sack = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    /* Ignore ACKs for frames that were never sent */
+    if(seq_before(channel.next_seq, ack))
+	return 1;
+
+    /* Cumulative part: everything before ack arrived */
+    for(uint16_t seq = channel.base; seq_before(seq, ack); seq++)
+	slot_for(channel, seq).acked = true;
+
+    /* Selective part: frames received after the first gap */
+    for(int bit = 0; bit < 32; bit++)
+    {
+	if(!(sack & (1UL << bit)))
+	    continue;
+
+	uint16_t seq = ack + 1 + bit;
+	if(seq_before(seq, channel.base) || !seq_before(seq, channel.next_seq))
+	    continue;
+
+	tx_slot &slot = slot_for(channel, seq);
+	if(slot.in_use && slot.seq == seq)
+	    slot.acked = true;
+    }
+
+    advance_base(channel);
+    return 0;
+}
+
+int rely_poll(rely_session &session, int timeout_ms)
+{
+    unsigned char frame[USB_MSG_SIZE];
+    int actual = 0;
+    int status = 0;
+
+    /* No phone attached (e.g. the test harness): only the timers run */
+    int returnVal = LIBUSB_ERROR_TIMEOUT;
+    if(session.handle != NULL)
+	returnVal = libusb_bulk_transfer(session.handle, config_get().in_point,
+					 frame, sizeof(frame), &actual,
+					 timeout_ms);
+    if(returnVal == 0 && actual > 0)
+    {
+	if(actual >= FRAME_HEADER_SIZE && frame[1] == FRAME_ACK)
+	    rely_handle_ack(session, frame, actual);
+	else if(session.on_frame != NULL)
+	    session.on_frame(session, frame, actual);
+    }
+    else if(returnVal != 0 && returnVal != LIBUSB_ERROR_TIMEOUT)
+    {
+	std::cout << "Receive error: " << libusb_error_name(returnVal)
+		  << std::endl;
+	status = 1;
+    }
+
+    /* Resend every reliable frame whose timer has expired */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(int cls = 0; cls < NUM_MSG_CLASSES; cls++)
+    {
+	tx_channel &channel = session.channels[cls];
+	if(!channel.config.reliable)
+	    continue;
+
+	for(uint16_t seq = channel.base; seq != channel.next_seq; seq++)
+	{
+	    tx_slot &slot = slot_for(channel, seq);
+	    if(!slot.in_use || slot.acked
+	       || elapsed_ms(slot.sent, now) < channel.config.rto_ms)
+		continue;
+
+	    if(slot.retries >= channel.config.max_retries)
+	    {
+		if(log_enabled(LOG_DEBUG))
+		    std::cout << "Dropping frame " << seq << " of class "
+			      << cls << std::endl;
+		slot.in_use = false;
+		channel.dropped++;
+		advance_base(channel);
+		continue;
+	    }
+
+	    /* Earlier frames may have been dropped since the last send */
+	    slot.frame[3] |= FRAME_FLAG_RETX;
+	    put_u16(&slot.frame[FRAME_HEADER_SIZE], channel.base);
+	    slot.retries++;
+	    slot.sent = now;
+	    channel.retransmits++;
+
+	    if(write_frame(session.handle, slot.frame, slot.length) != 0)
+		status = 1;
+	}
+
+	advance_base(channel);
+    }
+
+    return status;
+}
+
+int rely_pending(const rely_session &session, msg_class cls)
+{
+    if(cls < 0 || cls >= NUM_MSG_CLASSES)
+	return 0;
+
+    const tx_channel &channel = session.channels[cls];
+    int pending = 0;
+
+    for(uint16_t seq = channel.base; seq != channel.next_seq; seq++)
+    {
+	const tx_slot &slot = channel.slots[seq % RELY_WINDOW_MAX];
+	if(slot.in_use && !slot.acked)
+	    pending++;
+    }
+
+    return pending;
+}
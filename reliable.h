@@ -0,0 +1,201 @@
+/**
+ * reliable.h
+ * UBCST Electrical Division
+ * Reliable delivery layer on top of the accessory bulk pipes.
+ *
+ * Every frame sent on the OUT endpoint carries a sequence number and
+ * a priority class. The phone answers on the IN endpoint with an ACK
+ * frame that holds a cumulative ACK (the next sequence number it
+ * expects) and a selective ACK bitmap for frames received after a gap. Reliable
+ * classes keep unacknowledged frames in a sliding window and resend
+ * them when their retransmit timeout expires. Best-effort classes are
+ * numbered the same way but never buffered.
+ *
+ * Frame layout (multi-byte fields are little-endian):
+ *   byte 0    - FRAME_SYNC
+ *   byte 1    - frame type (FRAME_DATA, FRAME_ACK or FRAME_CMD)
+ *   byte 2    - priority class (CMD: command type)
+ *   byte 3    - flags (FRAME_FLAG_RETX on a retransmission)
+ *   bytes 4-5 - sequence number (DATA), cumulative ACK (ACK) or
+ *               command ID (CMD)
+ *   bytes 6-7 - payload length
+ *   bytes 8.. - payload (ACK: 32-bit SACK bitmap, bit i = ack + 1 + i)
+ *
+ * Reliable DATA frames set FRAME_FLAG_BASE and start their payload with
+ * the lowest sequence number the sender still holds for the class (2
+ * bytes, rewritten on every retransmission). A frame dropped after
+ * max_retries falls below it, so the phone moves its cumulative ACK up
+ * to the base instead of waiting for the frame forever.
+ *
+ * Inbound frames other than ACKs are handed to the session's on_frame
+ * hook, see command.h.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <libusb.h>
+
+#include "comms.h"
+
+/* Header Guard */
+#ifndef RELIABLE_H
+#define RELIABLE_H
+
+/* Frame header */
+#define FRAME_SYNC 0xA5
+#define FRAME_DATA 0x01
+#define FRAME_ACK  0x02
+#define FRAME_CMD  0x03
+#define FRAME_FLAG_RETX 0x01
+#define FRAME_FLAG_BASE 0x02
+#define FRAME_HEADER_SIZE 8
+#define FRAME_BASE_SIZE 2
+#define FRAME_PAYLOAD_SIZE (USB_MSG_SIZE - FRAME_HEADER_SIZE)
+
+/* Largest window any class may be configured with */
+#define RELY_WINDOW_MAX 32
+
+/* Bulk transfer timeout used when writing a frame (ms) */
+#define RELY_TX_TIMEOUT 100
+
+/* Priority classes */
+enum msg_class
+{
+    CLASS_TELEMETRY = 0, /* live telemetry, best-effort by default */
+    CLASS_ALARM = 1,     /* alarms and faults, guaranteed by default */
+    NUM_MSG_CLASSES
+};
+
+/* Per-class delivery settings */
+struct class_config
+{
+    bool reliable;   /* buffer and retransmit until ACKed */
+    int window;      /* frames in flight, 1 to RELY_WINDOW_MAX */
+    int rto_ms;      /* retransmit timeout */
+    int max_retries; /* give up on a frame after this many resends */
+};
+
+/* A frame held for retransmission */
+struct tx_slot
+{
+    bool in_use;
+    bool acked;
+    uint16_t seq;
+    int retries;
+    struct timespec sent;
+    int length;
+    unsigned char frame[USB_MSG_SIZE];
+};
+
+/* Send state of one priority class */
+struct tx_channel
+{
+    struct class_config config;
+    uint16_t base;     /* oldest unacknowledged sequence number */
+    uint16_t next_seq; /* sequence number of the next new frame */
+    struct tx_slot slots[RELY_WINDOW_MAX];
+
+    /* Counters */
+    unsigned long sent;
+    unsigned long retransmits;
+    unsigned long dropped;
+};
+
+struct rely_session;
+
+/* Receives inbound frames that are not ACKs, in the receive buffer */
+typedef void (*rely_frame_fn)(rely_session &session,
+			      const unsigned char *frame, int length);
+
+/* Reliable delivery session over one accessory handle */
+struct rely_session
+{
+    libusb_device_handle *handle;
+    struct tx_channel channels[NUM_MSG_CLASSES];
+    rely_frame_fn on_frame; /* may be NULL */
+};
+
+/**
+ * rely_init()
+ * Initializes a session: telemetry best-effort, alarms reliable with
+ * the window and timeouts from the configuration.
+ * Parameters:
+ *   session - the session to initialize
+ *   handle - the accessory device handle
+ * Returns:
+ *   None
+ */
+void rely_init(rely_session &session, libusb_device_handle *handle);
+
+/**
+ * rely_configure()
+ * Changes the delivery settings of a priority class. Frames already
+ * in flight keep their old window position.
+ * Parameters:
+ *   session - the session
+ *   cls - the priority class
+ *   config - the new settings
+ * Returns:
+ *   0 - if the settings were applied
+ *   1 - if the settings are out of range
+ */
+int rely_configure(rely_session &session, msg_class cls,
+		   const class_config &config);
+
+/**
+ * rely_send()
+ * Frames a payload and writes it to the OUT endpoint. Reliable classes
+ * keep a copy in the window until the phone acknowledges it.
+ * Parameters:
+ *   session - the session
+ *   cls - the priority class
+ *   payload - the payload bytes
+ *   length - the payload size, at most usb_msg_size - FRAME_HEADER_SIZE
+ *     (less FRAME_BASE_SIZE on a reliable class)
+ * Returns:
+ *   0 - if the frame was sent (or buffered for retransmission)
+ *   1 - if the window is full or the transfer failed
+ */
+int rely_send(rely_session &session, msg_class cls,
+	      const unsigned char *payload, int length);
+
+/**
+ * rely_handle_ack()
+ * Applies an ACK frame received from the phone.
+ * Parameters:
+ *   session - the session
+ *   frame - the received frame
+ *   length - the number of bytes received
+ * Returns:
+ *   0 - if the frame was a valid ACK
+ *   1 - otherwise
+ */
+int rely_handle_ack(rely_session &session, const unsigned char *frame,
+		    int length);
+
+/**
+ * rely_poll()
+ * Reads one frame from the IN endpoint, applies it if it is an ACK or
+ * passes it to on_frame otherwise, then resends every reliable frame
+ * whose retransmit timeout expired. Without a handle only the timers
+ * run.
+ * Parameters:
+ *   session - the session
+ *   timeout_ms - how long to wait for an inbound frame
+ * Returns:
+ *   0 - if no transfer error occurred
+ *   1 - if the inbound or retransmit transfer failed
+ */
+int rely_poll(rely_session &session, int timeout_ms);
+
+/**
+ * rely_pending()
+ * Parameters:
+ *   session - the session
+ *   cls - the priority class
+ * Returns:
+ *   the number of frames of the class still waiting for an ACK
+ */
+int rely_pending(const rely_session &session, msg_class cls);
+
+#endif /* End header guard */
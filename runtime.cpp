@@ -0,0 +1,245 @@
+/**
+ * runtime.cpp
+ * UBCST Electrical Division
+ * Real-time setup for the acquisition process.
+ */
+
+#include <iostream>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "runtime.h"
+#include "config.h"
+
+static const char *ROLE_NAMES[NUM_RT_ROLES] = { "acquisition", "usb", "logging" };
+
+/**
+ * prefault_stack()
+ * Touches RT_STACK_PREFAULT bytes of stack below the caller
+ */
+static void __attribute__((noinline)) prefault_stack(void)
+{
+    volatile unsigned char stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+
+    for(size_t i = 0; i < sizeof(stack); i += page)
+	stack[i] = 0;
+}
+
+/**
+ * all_cpus()
+ * Fills set with every configured core
+ */
+static void all_cpus(cpu_set_t &set)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    CPU_ZERO(&set);
+    for(long i = 0; i < cpus && i < CPU_SETSIZE; i++)
+	CPU_SET(i, &set);
+}
+
+int rt_setup_process(void)
+{
+    if(!config_get().lock_memory)
+	return 0;
+
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+	std::cout << "Error " << errno << " from mlockall: "
+		  << strerror(errno) << std::endl;
+	return 1;
+    }
+
+    prefault_stack();
+    return 0;
+}
+
+int rt_setup_thread(rt_role role)
+{
+    const telemetry_config &config = config_get();
+    int cpu = -1;
+    int priority = 0;
+    int status = 0;
+
+    switch(role)
+    {
+    case RT_ACQUISITION:
+	cpu = config.acq_cpu;
+	priority = config.acq_priority;
+	break;
+    case RT_USB:
+	cpu = config.usb_cpu;
+	priority = config.usb_priority;
+	break;
+    case RT_LOGGING:
+	cpu = config.log_cpu;
+	priority = config.log_priority;
+	break;
+    default:
+	return 1;
+    }
+
+    /* An unconfigured role gets every core and normal scheduling, not
+     * whatever the creating thread had */
+    cpu_set_t set;
+    if(cpu >= 0)
+    {
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+    }
+    else
+    {
+	all_cpus(set);
+    }
+
+    int returnVal = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(returnVal != 0)
+    {
+	std::cout << "Cannot set CPU affinity of " << ROLE_NAMES[role]
+		  << " thread: " << strerror(returnVal) << std::endl;
+	status = 1;
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    returnVal = pthread_setschedparam(pthread_self(),
+				      priority > 0 ? SCHED_FIFO : SCHED_OTHER,
+				      &param);
+    if(returnVal != 0)
+    {
+	std::cout << "Cannot set " << (priority > 0 ? "SCHED_FIFO " : "SCHED_OTHER ")
+		  << priority << " for " << ROLE_NAMES[role] << " thread: "
+		  << strerror(returnVal) << std::endl;
+	status = 1;
+    }
+
+    return status;
+}
+
+int rt_thread_create(pthread_t &thread, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t set;
+
+    memset(&param, 0, sizeof(param));
+    all_cpus(set);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_THREAD_STACK);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+    int returnVal = pthread_create(&thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if(returnVal != 0)
+    {
+	std::cout << "Cannot create thread: " << strerror(returnVal) << std::endl;
+	return 1;
+    }
+
+    return 0;
+}
+
+void rt_prefault(void *buf, size_t len)
+{
+    volatile unsigned char *p = (volatile unsigned char *)buf;
+    long page = sysconf(_SC_PAGESIZE);
+
+    for(size_t i = 0; i < len; i += page)
+	p[i] = p[i];
+
+    if(len > 0)
+	p[len - 1] = p[len - 1];
+}
+
+static int64_t diff_ns(const struct timespec &from, const struct timespec &to)
+{
+    return (int64_t)(to.tv_sec - from.tv_sec) * 1000000000 +
+	(to.tv_nsec - from.tv_nsec);
+}
+
+static void add_ns(struct timespec &t, int64_t ns)
+{
+    t.tv_sec += ns / 1000000000;
+    t.tv_nsec += ns % 1000000000;
+    if(t.tv_nsec >= 1000000000L)
+    {
+	t.tv_nsec -= 1000000000L;
+	t.tv_sec++;
+    }
+}
+
+void rt_jitter_init(rt_jitter &jitter, int64_t period_ns)
+{
+    memset(&jitter, 0, sizeof(jitter));
+    jitter.period_ns = period_ns;
+    clock_gettime(CLOCK_MONOTONIC, &jitter.next);
+    add_ns(jitter.next, period_ns);
+}
+
+int64_t rt_jitter_wait(rt_jitter &jitter)
+{
+    struct timespec now;
+
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &jitter.next, NULL)
+	  == EINTR)
+	;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t late = diff_ns(jitter.next, now);
+    if(late < 0)
+	late = 0;
+
+    jitter.count++;
+    jitter.sum_ns += late;
+    if(late > jitter.max_ns)
+	jitter.max_ns = late;
+
+    int bucket = 0;
+    for(int64_t bound = 1000; late >= bound && bucket < RT_JITTER_BUCKETS - 1;
+	bound *= 2)
+	bucket++;
+    jitter.buckets[bucket]++;
+
+    /* Keep the schedule, unless a whole period was lost */
+    add_ns(jitter.next, jitter.period_ns);
+    if(diff_ns(jitter.next, now) > 0)
+    {
+	jitter.next = now;
+	add_ns(jitter.next, jitter.period_ns);
+    }
+
+    return late;
+}
+
+void rt_jitter_report(const rt_jitter &jitter, const char *name)
+{
+    if(jitter.count == 0)
+	return;
+
+    /* Upper bound of the bucket holding the 99th percentile */
+    uint64_t target = jitter.count - jitter.count / 100;
+    uint64_t seen = 0;
+    int64_t p99 = 1000;
+    for(int b = 0; b < RT_JITTER_BUCKETS; b++, p99 *= 2)
+    {
+	seen += jitter.buckets[b];
+	if(seen >= target)
+	    break;
+    }
+
+    std::cout << "Jitter " << name << ": " << jitter.count << " wake-ups, mean "
+	      << (int64_t)(jitter.sum_ns / jitter.count) / 1000 << " us, p99 < "
+	      << p99 / 1000 << " us, max " << jitter.max_ns / 1000 << " us"
+	      << std::endl;
+}
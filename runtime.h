@@ -0,0 +1,137 @@
+/**
+ * runtime.h
+ * UBCST Electrical Division
+ * Real-time setup for the acquisition process.
+ *
+ * At startup the process can lock its memory and pre-fault its stack so
+ * that no page fault lands in a hot path. Each thread then declares its
+ * role, which pins it to the configured core and optionally gives it a
+ * SCHED_FIFO priority. Threads are started with rt_thread_create() so
+ * they neither inherit the creator's pinning and priority nor lock a
+ * full default-sized stack. Periodic loops measure how late each wake-up is
+ * with an rt_jitter meter and report it with the other statistics.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Header Guard */
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+/* Stack pre-faulted by rt_setup_process() (bytes) */
+#define RT_STACK_PREFAULT (256 * 1024)
+
+/* Stack of threads started by rt_thread_create() (bytes); with
+ * lock_memory every byte of it stays resident */
+#define RT_THREAD_STACK (256 * 1024)
+
+/* Jitter histogram buckets: <1us, <2us, <4us ... doubling */
+#define RT_JITTER_BUCKETS 24
+
+/* Thread roles */
+enum rt_role
+{
+    RT_ACQUISITION = 0, /* GPS and sensor reads */
+    RT_USB = 1,         /* USB transfers and event handling */
+    RT_LOGGING = 2,     /* logging and statistics */
+    NUM_RT_ROLES
+};
+
+/* Wake-up lateness of a periodic loop. Times are 64-bit so that they
+   do not overflow where long is 32 bits (armhf). */
+struct rt_jitter
+{
+    int64_t period_ns;
+    struct timespec next; /* next deadline */
+    uint64_t count;
+    int64_t max_ns;
+    double sum_ns;
+    uint64_t buckets[RT_JITTER_BUCKETS];
+};
+
+/**
+ * rt_setup_process()
+ * Locks current and future memory and pre-faults the stack, if
+ * lock_memory is set.
+ * Returns:
+ *   0 - if every requested setting was applied
+ *   1 - otherwise (the process keeps running without it)
+ */
+int rt_setup_process(void);
+
+/**
+ * rt_setup_thread()
+ * Pins the calling thread to the core configured for its role and
+ * applies the configured SCHED_FIFO priority. A core of -1 allows every
+ * core and a priority of 0 selects SCHED_OTHER.
+ * Parameters:
+ *   role - the thread's role
+ * Returns:
+ *   0 - if every requested setting was applied
+ *   1 - otherwise (the thread keeps running without it)
+ */
+int rt_setup_thread(rt_role role);
+
+/**
+ * rt_thread_create()
+ * Starts a thread with an RT_THREAD_STACK stack, SCHED_OTHER and every
+ * core allowed; the thread then calls rt_setup_thread() for its role.
+ * Parameters:
+ *   thread - the new thread, on success
+ *   fn - the thread function
+ *   arg - its argument
+ * Returns:
+ *   0 - if the thread was started
+ *   1 - otherwise
+ */
+int rt_thread_create(pthread_t &thread, void *(*fn)(void *), void *arg);
+
+/**
+ * rt_prefault()
+ * Touches every page of a buffer so later accesses do not fault.
+ * Parameters:
+ *   buf - the buffer
+ *   len - its size in bytes
+ * Returns:
+ *   None
+ */
+void rt_prefault(void *buf, size_t len);
+
+/**
+ * rt_jitter_init()
+ * Starts a periodic schedule from now.
+ * Parameters:
+ *   jitter - the meter
+ *   period_ns - the loop period
+ * Returns:
+ *   None
+ */
+void rt_jitter_init(rt_jitter &jitter, int64_t period_ns);
+
+/**
+ * rt_jitter_wait()
+ * Sleeps until the next deadline and records how late the wake-up was.
+ * Deadlines are absolute, so lateness does not accumulate; if a whole
+ * period was missed the schedule restarts from now.
+ * Parameters:
+ *   jitter - the meter
+ * Returns:
+ *   the lateness of this wake-up in nanoseconds
+ */
+int64_t rt_jitter_wait(rt_jitter &jitter);
+
+/**
+ * rt_jitter_report()
+ * Prints the count, mean, maximum and 99th percentile lateness.
+ * Parameters:
+ *   jitter - the meter
+ *   name - the loop name
+ * Returns:
+ *   None
+ */
+void rt_jitter_report(const rt_jitter &jitter, const char *name);
+
+#endif /* End header guard */
@@ -4,6 +4,8 @@
  * UBCST Electrical Division
  */
 
+#include <iostream>
+
 #include "sensor.h"
 
 /* TODO Complete the sensor source code */
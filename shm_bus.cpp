@@ -0,0 +1,277 @@
+/**
+ * shm_bus.cpp
+ * UBCST Electrical Division
+ * Shared-memory telemetry bus for other processes on the car.
+ */
+
+#include <sys/mman.h>
+
+#include "shm_bus.h"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+	      "bus atomics must be lock-free to work across processes");
+static_assert((BUS_SLOTS & (BUS_SLOTS - 1)) == 0,
+	      "BUS_SLOTS must be a power of two");
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int bus_create(bus_publisher &pub)
+{
+    pub.bus = NULL;
+
+    int fd = shm_open(BUS_NAME, O_CREAT | O_RDWR, 0644);
+    if(fd < 0)
+    {
+	std::cout << "Error " << errno << " creating " << BUS_NAME << ": "
+		  << strerror(errno) << std::endl;
+	return 1;
+    }
+
+    if(ftruncate(fd, sizeof(bus_header)) != 0)
+    {
+	std::cout << "Error " << errno << " sizing " << BUS_NAME << ": "
+		  << strerror(errno) << std::endl;
+	close(fd);
+	return 1;
+    }
+
+    void *map = mmap(NULL, sizeof(bus_header), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+	std::cout << "Error " << errno << " mapping " << BUS_NAME << ": "
+		  << strerror(errno) << std::endl;
+	return 1;
+    }
+
+    /* Clear any previous run; readers check the magic number */
+    bus_header *bus = (bus_header *)map;
+    memset(map, 0, sizeof(bus_header));
+    bus->version = BUS_VERSION;
+    bus->slots = BUS_SLOTS;
+    bus->record_size = sizeof(bus_record);
+    std::atomic_thread_fence(std::memory_order_release);
+    bus->magic = BUS_MAGIC;
+
+    /* A publisher preempted mid-record must not hold up a real-time one */
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&pub.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pub.bus = bus;
+    return 0;
+}
+
+/**
+ * begin_publish()
+ * Claims the next slot and marks it as being written, holding the
+ * publisher lock until end_publish()
+ * Returns:
+ *   the record to fill in, or NULL if the bus is not open
+ */
+static bus_record *begin_publish(bus_publisher &pub, bus_type type)
+{
+    bus_header *bus = pub.bus;
+    if(bus == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&pub.lock);
+    uint64_t index = bus->head.load(std::memory_order_relaxed);
+    bus_slot &slot = bus->ring[index & (BUS_SLOTS - 1)];
+
+    /* Odd: write in progress */
+    slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.record.type = type;
+    slot.record.index = index;
+    slot.record.time_ns = now_ns();
+    return &slot.record;
+}
+
+/**
+ * end_publish()
+ * Marks the record claimed by begin_publish() complete and releases
+ * the publisher lock
+ */
+static void end_publish(bus_publisher &pub, bus_type type)
+{
+    bus_header *bus = pub.bus;
+    uint64_t index = bus->head.load(std::memory_order_relaxed);
+    bus_slot &slot = bus->ring[index & (BUS_SLOTS - 1)];
+
+    /* Even: record complete */
+    slot.seq.store(2 * index + 2, std::memory_order_release);
+    bus->latest[type].store(index + 1, std::memory_order_release);
+    bus->head.store(index + 1, std::memory_order_release);
+    pthread_mutex_unlock(&pub.lock);
+}
+
+void bus_publish_gps(bus_publisher &pub, const gps_data &data,
+		     const struct timespec &arrival)
+{
+    bus_record *record = begin_publish(pub, BUS_GPS);
+    if(record == NULL)
+	return;
+
+    bus_gps &gps = record->gps;
+    strncpy(gps.timeStamp, data.timeStamp.c_str(), sizeof(gps.timeStamp) - 1);
+    gps.timeStamp[sizeof(gps.timeStamp) - 1] = '\0';
+    gps.latitude = data.latitude;
+    gps.longitude = data.longitude;
+    gps.northsouth = data.northsouth.empty() ? '\0' : data.northsouth[0];
+    gps.eastwest = data.eastwest.empty() ? '\0' : data.eastwest[0];
+    gps.speed = data.speed;
+    gps.course = data.course;
+    gps.arrival_ns = (uint64_t)arrival.tv_sec * 1000000000ULL + arrival.tv_nsec;
+
+    end_publish(pub, BUS_GPS);
+}
+
+void bus_publish_sensor(bus_publisher &pub, const sensor_data &data)
+{
+    bus_record *record = begin_publish(pub, BUS_SENSOR);
+    if(record == NULL)
+	return;
+
+    record->sensor = data;
+    end_publish(pub, BUS_SENSOR);
+}
+
+void bus_publish_position(bus_publisher &pub, const est_position &position)
+{
+    bus_record *record = begin_publish(pub, BUS_POSITION);
+    if(record == NULL)
+	return;
+
+    record->position = position;
+    end_publish(pub, BUS_POSITION);
+}
+
+void bus_destroy(bus_publisher &pub)
+{
+    if(pub.bus == NULL)
+	return;
+
+    munmap(pub.bus, sizeof(bus_header));
+    shm_unlink(BUS_NAME);
+    pub.bus = NULL;
+    pthread_mutex_destroy(&pub.lock);
+}
+
+int bus_open(bus_reader &reader)
+{
+    reader.bus = NULL;
+    reader.next = 0;
+    reader.missed = 0;
+
+    int fd = shm_open(BUS_NAME, O_RDONLY, 0);
+    if(fd < 0)
+	return 1;
+
+    void *map = mmap(NULL, sizeof(bus_header), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+	return 1;
+
+    const bus_header *bus = (const bus_header *)map;
+    if(bus->magic != BUS_MAGIC || bus->version != BUS_VERSION
+       || bus->slots != BUS_SLOTS || bus->record_size != sizeof(bus_record))
+    {
+	std::cout << "Incompatible telemetry bus" << std::endl;
+	munmap(map, sizeof(bus_header));
+	return 1;
+    }
+
+    uint64_t head = bus->head.load(std::memory_order_acquire);
+    reader.bus = bus;
+    reader.next = head > BUS_SLOTS ? head - BUS_SLOTS : 0;
+    return 0;
+}
+
+/**
+ * read_slot()
+ * Copies record index if its slot still holds it
+ * Returns:
+ *   0 - if a consistent copy was made
+ *   1 - if the record is being written or was overwritten
+ */
+static int read_slot(const bus_header *bus, uint64_t index, bus_record &record)
+{
+    const bus_slot &slot = bus->ring[index & (BUS_SLOTS - 1)];
+
+    for(int tries = 0; tries < BUS_READ_TRIES; tries++)
+    {
+	uint64_t before = slot.seq.load(std::memory_order_acquire);
+	if(before > 2 * index + 2)
+	    return 1; /* overwritten by a newer record */
+	if(before != 2 * index + 2)
+	    continue; /* being written */
+
+	memcpy(&record, (const void *)&slot.record, sizeof(record));
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	if(slot.seq.load(std::memory_order_relaxed) == before)
+	    return 0;
+    }
+
+    return 1;
+}
+
+int bus_read_latest(bus_reader &reader, bus_type type, bus_record &record)
+{
+    if(reader.bus == NULL || type < 0 || type >= NUM_BUS_TYPES)
+	return 1;
+
+    uint64_t latest = reader.bus->latest[type].load(std::memory_order_acquire);
+    if(latest == 0)
+	return 1;
+
+    return read_slot(reader.bus, latest - 1, record);
+}
+
+int bus_read_next(bus_reader &reader, bus_record &record)
+{
+    if(reader.bus == NULL)
+	return 1;
+
+    while(true)
+    {
+	uint64_t head = reader.bus->head.load(std::memory_order_acquire);
+	if(reader.next >= head)
+	    return 1;
+
+	/* Lapped: jump to the oldest record still in the ring */
+	if(head - reader.next > BUS_SLOTS)
+	{
+	    reader.missed += head - BUS_SLOTS - reader.next;
+	    reader.next = head - BUS_SLOTS;
+	}
+
+	if(read_slot(reader.bus, reader.next, record) == 0)
+	{
+	    reader.next++;
+	    return 0;
+	}
+
+	/* Overwritten while reading; skip it */
+	reader.missed++;
+	reader.next++;
+    }
+}
+
+void bus_close(bus_reader &reader)
+{
+    if(reader.bus != NULL)
+	munmap((void *)reader.bus, sizeof(bus_header));
+
+    reader.bus = NULL;
+}
@@ -0,0 +1,228 @@
+/**
+ * shm_bus.h
+ * UBCST Electrical Division
+ * Shared-memory telemetry bus for other processes on the car.
+ *
+ * The telemetry program publishes every GPS fix, every position
+ * estimate (and, once sensor.cpp reads hardware, every sensor reading)
+ * into a ring of slots in a
+ * POSIX shared-memory object. Any number of
+ * processes (display, CAN bridge, logger) can map it read-only and read
+ * either the latest record of a type or every record in order, without
+ * system calls and without taking a lock.
+ *
+ * Each slot is a seqlock. While the publisher writes record n
+ * the slot sequence is 2n + 1; once the record is complete it is
+ * 2n + 2. A reader copies the slot and accepts the copy only if the
+ * sequence was 2n + 2 both before and after, so a torn or overwritten
+ * record is never returned. Threads of the publishing process take
+ * turns through a priority-inheritance mutex; readers never lock.
+ */
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "gps.h"
+#include "sensor.h"
+#include "estimator.h"
+
+/* Header Guard */
+#ifndef SHM_BUS_H
+#define SHM_BUS_H
+
+/* Name of the shared-memory object (/dev/shm/telemetry_bus) */
+#define BUS_NAME "/telemetry_bus"
+
+#define BUS_MAGIC 0x55425354 /* "UBST" */
+#define BUS_VERSION 3
+
+/* Number of ring slots, a power of two */
+#define BUS_SLOTS 256
+
+/* Attempts at a consistent copy before a read gives up */
+#define BUS_READ_TRIES 16
+
+/* Record types */
+enum bus_type
+{
+    BUS_GPS = 0,
+    BUS_SENSOR = 1,
+    BUS_POSITION = 2,
+    NUM_BUS_TYPES
+};
+
+/* GPS fix without heap-allocated strings */
+struct bus_gps
+{
+    char timeStamp[16];
+    double latitude;
+    double longitude;
+    char northsouth;
+    char eastwest;
+    double speed;  /* knots, -1 if not reported */
+    double course; /* degrees true, -1 if not reported */
+    uint64_t arrival_ns; /* CLOCK_MONOTONIC when the sentence's first
+			  * byte arrived */
+};
+
+/* One published record */
+struct bus_record
+{
+    uint32_t type;    /* bus_type */
+    uint64_t index;   /* position in the stream, from 0 */
+    uint64_t time_ns; /* CLOCK_MONOTONIC when published */
+    union
+    {
+	struct bus_gps gps;
+	struct sensor_data sensor;
+	struct est_position position;
+    };
+};
+
+/* Seqlock-protected slot, one per cache line pair */
+struct alignas(64) bus_slot
+{
+    std::atomic<uint64_t> seq;
+    struct bus_record record;
+};
+
+/* Layout of the shared-memory object */
+struct bus_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t record_size;
+
+    /* Number of records published */
+    alignas(64) std::atomic<uint64_t> head;
+
+    /* Index + 1 of the latest record of each type, 0 if none */
+    std::atomic<uint64_t> latest[NUM_BUS_TYPES];
+
+    struct bus_slot ring[BUS_SLOTS];
+};
+
+/* Publisher side */
+struct bus_publisher
+{
+    struct bus_header *bus;
+    pthread_mutex_t lock; /* serializes publishing threads */
+};
+
+/* Subscriber side */
+struct bus_reader
+{
+    const struct bus_header *bus;
+    uint64_t next;        /* index of the next record for bus_read_next() */
+    unsigned long missed; /* records overwritten before they were read */
+};
+
+/**
+ * bus_create()
+ * Creates (or resets) the shared-memory object and maps it for writing.
+ * Parameters:
+ *   pub - the publisher
+ * Returns:
+ *   0 - if the bus is ready
+ *   1 - otherwise
+ */
+int bus_create(bus_publisher &pub);
+
+/**
+ * bus_publish_gps()
+ * Publishes a GPS fix.
+ * Parameters:
+ *   pub - the publisher
+ *   data - the fix
+ *   arrival - when its sentence started arriving (gps_port.arrival)
+ * Returns:
+ *   None
+ */
+void bus_publish_gps(bus_publisher &pub, const gps_data &data,
+		     const struct timespec &arrival);
+
+/**
+ * bus_publish_sensor()
+ * Publishes a sensor reading.
+ * Parameters:
+ *   pub - the publisher
+ *   data - the reading
+ * Returns:
+ *   None
+ */
+void bus_publish_sensor(bus_publisher &pub, const sensor_data &data);
+
+/**
+ * bus_publish_position()
+ * Publishes a position estimate.
+ * Parameters:
+ *   pub - the publisher
+ *   position - the estimate
+ * Returns:
+ *   None
+ */
+void bus_publish_position(bus_publisher &pub, const est_position &position);
+
+/**
+ * bus_destroy()
+ * Unmaps and removes the shared-memory object.
+ * Parameters:
+ *   pub - the publisher
+ * Returns:
+ *   None
+ */
+void bus_destroy(bus_publisher &pub);
+
+/**
+ * bus_open()
+ * Maps an existing bus read-only. Reading starts at the oldest record
+ * still in the ring.
+ * Parameters:
+ *   reader - the subscriber
+ * Returns:
+ *   0 - if the bus was mapped
+ *   1 - if it does not exist or has an incompatible layout
+ */
+int bus_open(bus_reader &reader);
+
+/**
+ * bus_read_latest()
+ * Copies the most recent record of a type.
+ * Parameters:
+ *   reader - the subscriber
+ *   type - the record type
+ *   record - the copy
+ * Returns:
+ *   0 - if a consistent record was copied
+ *   1 - if none has been published or the publisher kept overwriting it
+ */
+int bus_read_latest(bus_reader &reader, bus_type type, bus_record &record);
+
+/**
+ * bus_read_next()
+ * Copies the next record in publication order. If the publisher has
+ * lapped the reader, skips to the oldest record still available and
+ * adds the skipped records to reader.missed.
+ * Parameters:
+ *   reader - the subscriber
+ *   record - the copy
+ * Returns:
+ *   0 - if a record was copied
+ *   1 - if no new record is available
+ */
+int bus_read_next(bus_reader &reader, bus_record &record);
+
+/**
+ * bus_close()
+ * Unmaps the bus.
+ * Parameters:
+ *   reader - the subscriber
+ * Returns:
+ *   None
+ */
+void bus_close(bus_reader &reader);
+
+#endif /* End header guard */